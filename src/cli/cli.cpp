@@ -2,28 +2,29 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <sstream>
 #include <string>
 
 #include "debug.hpp"
+#include "diagnostics.hpp"
 #include "globals.hpp"
+#include "idtag.hpp"
+#include "lrcfile.hpp"
 #include "metadata.hpp"
 #include "process.hpp"
 #include "token.hpp"
 
+// Exit status when the input was left as is, having nothing to change
+constexpr int unchanged_status = 3;
+
 // Utilities
 
-std::string
-parse_options (
-    long offset,
-    bool invert,
-    bool dropmetadata
-) {
-    return
-        "correctoffset"
-        // Allow the -o option to override whatever offset the file has
-        + (offset != 0 ? ":" + std::to_string(offset) : "") + " "
-        + (invert ? "invertoffset" : "") + " "
-        + (dropmetadata ? "dropmetadata" : "");
+// Tell the user a file was left alone, .lrc and audio files alike
+void
+report_unchanged (const fs::path &file)
+{
+    std::clog << file.string() << ": nothing to change, left as is." << std::endl;
 }
 
 fs::path
@@ -69,26 +70,23 @@ atomic_write_lrc_file (
     return 0;
 }
 
-filelines
-read_lines_from_stdin ()
+// Read a whole .lrc document, its lines split like lrc_file splits them
+lrc_file
+read_lrc_document (std::istream &in)
 {
-    filelines feed;
-    // read stdin line by line
-    std::string line;
-    while (std::getline(std::cin, line))          // blocks until pipe closes
-        feed.push_back(std::move(line));
-    if (!std::cin.eof() && std::cin.bad()) {       // real I/O error
-        std::cerr << "i/o error: couldn't read stdin";
-        return feed;
-    }
+    std::ostringstream contents;
+    contents << in.rdbuf();                         // blocks until pipe closes
 
-    return feed;
+    if (in.bad())                                   // real I/O error
+        std::cerr << "i/o error: couldn't read the .lrc input" << std::endl;
+
+    return lrc_file::from_memory(contents.view());
 }
 
 std::string
 which(const std::string &program)
 {
-    std::string cmd = trim_string(program);
+    std::string cmd(trim_view(program));
 
     // Take only the first word up to the first space
     size_t space_pos = cmd.find(' ');
@@ -115,39 +113,41 @@ int
 handle_lrc_file_directly (
     fs::path file,
     fs::path save_as,
-    long offset,
-    bool offset_provided,
-    bool invert,
-    bool dropmetadata
+    const lyric_pipeline &pipeline
 ) {
 
-    // Allow reading from file
+    // Allow reading from stdin, both ways below read the same input
     bool use_stdin = file == "-";
 
-    // options that will be fed to the process_lyrics engine
+    std::ifstream lrcfile;
+    if (!use_stdin) lrcfile.open(file, std::ios::binary);
 
-    std::string options = parse_options(offset, invert, dropmetadata);
+    std::istream &input = use_stdin ? std::cin : lrcfile;
 
-    // For debugging
-    LOG(options, "Processing lyrics with following options");
+    // Writing to stdout on one thread, so stream: every line is written
+    // as soon as it's read, without holding the whole document in
+    // memory. Saving and threads need the whole document first.
+    if (save_as.empty() && pipeline.options().threads == 1) {
+        std::size_t written = pipeline.stream(input, std::cout);
 
-    // Fire a warning if the user manually typed offset 0
-    if (offset_provided && offset == 0)
-        std::clog << "warning: -o 0 means \"use file offset\"; "
-                "file offset will be used.\n";
+        // Warn about empty file
+        if (written == 0)
+            std::cerr << "Input audio file had no lyrics metadata." << std::endl;
 
-    // to simplify code reading, we'll save the processed lyrics here
-    filelines processed_lyrics_tokens;
+        return 0;
+    }
 
-    // Allow reading from stdin
-    if (use_stdin) {
-        // Read .lrc data from stdin
-        filelines feed = read_lines_from_stdin();
-        processed_lyrics_tokens = process_lyrics(feed, options);
-    } else if (!file.empty()) {
-        processed_lyrics_tokens = process_lyrics(file, options);
+    lrc_file source = read_lrc_document(input);
+
+    // Re-runs over an already fixed file: don't even write it
+    if (!use_stdin && save_as == file && !pipeline.would_change(source.lines())) {
+        report_unchanged(file);
+        return unchanged_status;
     }
 
+    // to simplify code reading, we'll save the processed lyrics here
+    filelines processed_lyrics_tokens = pipeline.run(source.lines());
+
     // Warn about empty file
     if (processed_lyrics_tokens.size() == 0)
         std::cerr << "Input audio file had no lyrics metadata." << std::endl;
@@ -170,9 +170,7 @@ int
 handle_audio_file_directly (
     fs::path audio_file,
     fs::path save_as,
-    long offset,
-    bool offset_provided,
-    bool invert,
+    const lyric_pipeline &pipeline,     // must drop metadata, see main
     filelines source_lyrics // allows to override the lyrics inst
 )
 {
@@ -188,20 +186,11 @@ handle_audio_file_directly (
         return 1;
     }
 
-    // When working directly with audio metadata files, metadata MUST be dropped
-    // to avoid showing up in the player
-    std::string options = parse_options(offset, invert, true);
-
-    // Fire a warning if the user manually typed offset 0
-    if (offset_provided && offset == 0)
-        std::clog << "WARNING: -o 0 means \"use file offset\"; "
-                "file offset will be used.\n";
-
     // to simplify code reading, we'll save the processed lyrics here
     filelines processed_lyrics_tokens;
 
     // Feed the lyrics to process_lyrics
-    processed_lyrics_tokens = process_lyrics(source_lyrics, options);
+    processed_lyrics_tokens = pipeline.run(source_lyrics);
 
     // Warn about empty file
     if (processed_lyrics_tokens.size() == 0)
@@ -256,13 +245,22 @@ int main(int argc, char** argv)
     cxxopts::Options opt("syrinc", ".lrc offset fixer");
 
     opt.add_options()
-        ("f,file",      "input .lrc or song file, - to read from stdin",  cxxopts::value<std::string>())
+        ("f,file",      "input .lrc or song file, - to read from stdin (streamed only when printing with -j 1)",  cxxopts::value<std::string>())
         ("l,link-lrc", "override audio's .lrc metadata with an external file instead", cxxopts::value<std::string>())
         ("s,save-as", "Save output to path "
                                  "   (leave empty for stdout, type :in: to overwrite source file)", cxxopts::value<std::string>()->default_value(""))
         ("o,offset", "override offset, in ms", cxxopts::value<long>())
         ("i,invert",    "invert offset sign")
         ("d,drop-metadata", "Drop out lyrics metadata tags")
+        ("drop", "Also drop these ID tags, comma-separated (e.g. ti,ar,tool)", cxxopts::value<std::string>()->default_value(""))
+        ("header-only", "Only look for tags before the first lyric line, ignoring mid-file [offset:] tags")
+        ("verbatim", "Only rewrite timestamps and dropped tags, keeping the rest of every line byte for byte")
+        ("expand", "Split lines with several timestamps into one line each, in time order")
+        ("collapse", "Merge timed lines with the same text into one with all of their timestamps")
+        ("sort", "Put timed lines in time order")
+        ("dedup", "Drop timed lines that repeat one already kept")
+        ("time-scale", "Stretch every timestamp by this factor (e.g. 1.0427 for 23.976 to 25 fps)", cxxopts::value<double>()->default_value("1"))
+        ("j,jobs", "Split big lyric files across this many threads, 0 for one per core", cxxopts::value<unsigned>()->default_value("1"))
         ("h,help",      "print full help");
 
     const char* examples = R"(
@@ -284,6 +282,9 @@ Examples:
 
   Correct timestamps with time offset - standalone .lrc
     syrinc -f lyrics.lrc -s :in:
+
+  Drop the usual metadata plus the [tool:] tag
+    syrinc -f lyrics.lrc -d --drop tool -s :in:
 )";
 
     try {
@@ -305,6 +306,29 @@ Examples:
         std::string save_as        = result["save-as"].as<std::string>();
         bool        invert         = result["invert"].as<bool>();
         bool        dropmetadata   = result["drop-metadata"].as<bool>();
+        std::string drop_list      = result["drop"].as<std::string>();
+        bool        headeronly     = result["header-only"].as<bool>();
+        unsigned    jobs           = result["jobs"].as<unsigned>();
+        bool        verbatim       = result["verbatim"].as<bool>();
+        bool        sort           = result["sort"].as<bool>();
+        bool        dedup          = result["dedup"].as<bool>();
+        double      time_scale     = result["time-scale"].as<double>();
+        bool        expand         = result["expand"].as<bool>();
+        bool        collapse       = result["collapse"].as<bool>();
+
+        // Catch typos in --drop now, rather than silently keeping the tag
+        std::optional<id_tag_set> drop = parse_id_tag_set(drop_list);
+        if (!drop) {
+            std::cerr << "Unknown ID tag in --drop \"" << drop_list << "\". Known tags:";
+            for (const id_tag_key &k : id_tag_keys) std::cerr << ' ' << k.key;
+            std::cerr << std::endl;
+            return 1;
+        }
+
+        if (!(time_scale > 0)) {
+            std::cerr << "--time-scale must be a positive factor." << std::endl;
+            return 1;
+        }
 
         // Respect in-place overwrite
         if (save_as == ":in:") save_as = file;
@@ -335,38 +359,68 @@ Examples:
             return 1;
         }
 
+        // Fire a warning if the user manually typed offset 0
+        if (offset_provided && offset == 0)
+            std::clog << "warning: -o 0 means \"use file offset\"; "
+                    "file offset will be used.\n";
+
+        // Set up processing once for every document of this run
+        process_options options;
+        options.correct_offset = true;
+        // Allow the -o option to override whatever offset the file has
+        if (offset != 0) options.offset_override = offset;
+        options.invert_offset = invert;
+        // When working directly with audio metadata files, metadata
+        // MUST be dropped to avoid showing up in the player
+        options.drop = (dropmetadata || treat_as_audio ? default_dropped_tags : 0) | *drop;
+        options.header_only = headeronly;
+        options.threads = jobs;
+        options.verbatim = verbatim;
+        options.expand = expand;
+        options.sort = sort;
+        options.dedup = dedup;
+        options.time_scale = time_scale;
+        options.collapse = collapse;
+
+        const lyric_pipeline pipeline(options);
+
+        int status = 0;
+
         // Treat file as...
         if (treat_as_audio) {
-            return handle_audio_file_directly(
-                file,
-                save_as,
-                offset,
-                offset_provided,
-                invert,
-                // by default, just take whatever the audio metadata has
-                (link_lrc.empty() ? get_audio_lyrics(file) : 
-                    // else, process the external .lrc instead first
-                    process_lyrics(
-                        link_lrc,
-                        parse_options(offset, invert, 
-                        true // always drop metadata when dealing with audio files
-                        )
-                    )
-                )
-            );
+            // by default, just take whatever the audio metadata has
+            filelines source_lyrics = link_lrc.empty() ? get_audio_lyrics(file) :
+                // else, take the external .lrc as is, it's only
+                // processed once, by handle_audio_file_directly
+                lrc_file(fs::path(link_lrc)).to_filelines();
+
+            // Re-runs over an already fixed file: don't remux it for nothing
+            if (link_lrc.empty() && save_as == file && !pipeline.would_change(source_lyrics)) {
+                report_unchanged(file);
+                status = unchanged_status;
+            } else {
+                status = handle_audio_file_directly(
+                    file,
+                    save_as,
+                    pipeline,
+                    source_lyrics
+                );
+            }
         } else {
             if (!link_lrc.empty())
                 std::cout << "warning: both input files are .lrc, ignoring link-lrc input..." << std::endl;
-            return handle_lrc_file_directly(
+            status = handle_lrc_file_directly(
                 file,
                 save_as,
-                offset,
-                offset_provided,
-                invert,
-                dropmetadata
+                pipeline
             );
         }
 
+        // Warnings were buffered while processing, report them all at once
+        thread_diagnostics().flush(std::cerr);
+
+        return status;
+
     } catch (const cxxopts::exceptions::exception& e) {
         std::cerr << "Error: " << e.what() << "\n\n";
         std::cout << opt.help() << '\n'
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+* Character classes lrc-core cares about, one bit each.
+*
+* A single 256-entry table answers "what can this byte be?" for the
+* tokenizer, the tag reader and the timestamp scanner alike, so a
+* plain word gets rejected on its very first byte.
+*/
+enum char_class : uint8_t {
+    cc_digit          = 1 << 0,   // 0-9
+    cc_space          = 1 << 1,   // anything std::isspace accepts
+    cc_token_break    = 1 << 2,   // what tokenize_line splits on
+    cc_tag_delimiter  = 1 << 3,   // [ ] < >
+    cc_timestamp      = 1 << 4,   // digits, : . and the minus sign
+    cc_timestamp_head = 1 << 5    // what a timestamp can start with
+};
+
+inline constexpr std::array<uint8_t, 256> char_classes = []{
+    std::array<uint8_t, 256> table = {};
+
+    for (int c = '0'; c <= '9'; c++)
+        table[c] |= cc_digit | cc_timestamp | cc_timestamp_head;
+
+    for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+        table[c] |= cc_space;
+
+    table[' '] |= cc_token_break;
+
+    for (unsigned char c : {'[', ']', '<', '>'})
+        table[c] |= cc_tag_delimiter;
+
+    for (unsigned char c : {':', '.', '-'})
+        table[c] |= cc_timestamp;
+
+    table['-'] |= cc_timestamp_head;
+
+    return table;
+}();
+
+/**
+* @brief Tell if a byte belongs to any of the given classes.
+*/
+constexpr bool
+is_char (char c, uint8_t classes)
+{
+    return char_classes[static_cast<unsigned char>(c)] & classes;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+* Kinds of problems lrc-core can run into while processing lyrics.
+*/
+enum class diag_code {
+    rounded_timestamp,  // ss >= 60 or cs >= 100, carried over
+    bad_offset_value,   // [offset:] whose value isn't a number
+    count               // keep last
+};
+
+struct diagnostic {
+    diag_code code;
+    std::size_t line;       // 1-based, 0 if unknown
+    std::size_t column;     // 1-based, 0 if unknown
+    std::string message;
+};
+
+/**
+* @brief Buffered sink for warnings found while processing lyrics.
+*
+* Nothing gets written until flush is called, so a badly malformed
+* file costs one formatted report instead of one flush per warning.
+* Only the first max_repeats warnings of each code are kept in full,
+* the rest are just counted.
+*
+* A sink is not synchronized: give each thread its own, or use
+* thread_diagnostics().
+*/
+class diagnostics {
+    private:
+        std::size_t max_repeats;
+        std::vector<diagnostic> kept;
+        std::array<std::size_t, std::size_t(diag_code::count)> counts = {};
+
+    public:
+        diagnostics(std::size_t max_repeats = 8);
+
+        void
+        report (diag_code code, std::size_t line, std::size_t column, std::string message);
+
+        std::size_t
+        count (diag_code code) const;
+
+        std::size_t
+        total () const;
+
+        const std::vector<diagnostic> &
+        entries () const;
+
+        std::string
+        summary () const;
+
+        void
+        flush (std::ostream &out);
+
+        void
+        clear ();
+
+        std::size_t
+        repeat_limit () const;
+
+        void
+        merge (const diagnostics &later);
+};
+
+diagnostics &
+thread_diagnostics ();
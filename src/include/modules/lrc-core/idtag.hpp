@@ -0,0 +1,153 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+/**
+* The standard LRC ID tags, whatever key spelling they come with.
+*/
+enum class id_tag : uint8_t {
+    unknown = 0,
+    title,      // ti
+    artist,     // ar
+    album,      // al
+    author,     // au
+    lyricist,   // lr
+    length,     // le, length
+    creator,    // by
+    offset,     // offset, of
+    editor,     // re
+    tool,       // tool
+    version,    // ve, version
+    comment     // #
+};
+
+// One bit per id_tag, so a whole set fits in a register
+using id_tag_set = uint32_t;
+
+constexpr id_tag_set
+id_tag_bit (id_tag t)
+{
+    return t == id_tag::unknown ? 0 : id_tag_set(1) << unsigned(t);
+}
+
+// What dropmetadata has always dropped
+inline constexpr id_tag_set default_dropped_tags =
+    id_tag_bit(id_tag::title)   | id_tag_bit(id_tag::artist)  |
+    id_tag_bit(id_tag::album)   | id_tag_bit(id_tag::author)  |
+    id_tag_bit(id_tag::length)  | id_tag_bit(id_tag::creator) |
+    id_tag_bit(id_tag::editor)  | id_tag_bit(id_tag::version);
+
+struct id_tag_key {
+    std::string_view key;
+    id_tag tag = id_tag::unknown;
+};
+
+// Every key spelling that's recognized
+inline constexpr id_tag_key id_tag_keys[] = {
+    {"ti", id_tag::title},      {"ar", id_tag::artist},
+    {"al", id_tag::album},      {"au", id_tag::author},
+    {"lr", id_tag::lyricist},   {"le", id_tag::length},
+    {"length", id_tag::length}, {"by", id_tag::creator},
+    {"offset", id_tag::offset}, {"of", id_tag::offset},
+    {"re", id_tag::editor},     {"tool", id_tag::tool},
+    {"ve", id_tag::version},    {"version", id_tag::version},
+    {"#", id_tag::comment}
+};
+
+inline constexpr std::size_t id_tag_table_size = 32;
+
+/*
+* The length and the first, second and last bytes are enough to tell
+* every key apart; the seed is picked at compile time so that no two
+* keys share a slot.
+*/
+constexpr std::size_t
+id_tag_hash (std::string_view key, uint32_t seed)
+{
+    if (key.empty()) return 0;
+
+    uint32_t h = key.size();
+    h = h * seed + static_cast<unsigned char>(key[0]);
+    h = h * seed + static_cast<unsigned char>(key.size() > 1 ? key[1] : 0);
+    h = h * seed + static_cast<unsigned char>(key.back());
+
+    return (h ^ (h >> 11)) % id_tag_table_size;
+}
+
+inline constexpr uint32_t id_tag_seed = []{
+    for (uint32_t seed = 1; seed < 100000; seed++) {
+        std::array<bool, id_tag_table_size> taken = {};
+        bool perfect = true;
+
+        for (const id_tag_key &k : id_tag_keys) {
+            std::size_t slot = id_tag_hash(k.key, seed);
+            if (taken[slot]) { perfect = false; break; }
+            taken[slot] = true;
+        }
+
+        if (perfect) return seed;
+    }
+
+    return uint32_t(0);
+}();
+
+static_assert(id_tag_seed != 0, "no perfect hash seed for the LRC ID tag keys");
+
+inline constexpr std::array<id_tag_key, id_tag_table_size> id_tag_table = []{
+    std::array<id_tag_key, id_tag_table_size> table = {};
+
+    for (const id_tag_key &k : id_tag_keys)
+        table[id_tag_hash(k.key, id_tag_seed)] = k;
+
+    return table;
+}();
+
+/**
+* @brief Tell which ID tag a key stands for, with one hash and one compare.
+*
+* @code
+* static_assert(classify_id_tag("of") == id_tag::offset);
+* @endcode
+*
+* @param key the tag key, already trimmed
+*/
+constexpr id_tag
+classify_id_tag (std::string_view key)
+{
+    const id_tag_key &slot = id_tag_table[id_tag_hash(key, id_tag_seed)];
+    return slot.key == key ? slot.tag : id_tag::unknown;
+}
+
+/**
+* @brief Turn a comma-separated list of keys like "ti,ar,tool" into a set.
+*
+* Spaces around the keys are ignored, and so are empty entries.
+*
+* @return the set, or nothing if any key isn't a known ID tag
+*/
+constexpr std::optional<id_tag_set>
+parse_id_tag_set (std::string_view list)
+{
+    id_tag_set set = 0;
+
+    while (!list.empty()) {
+        std::size_t comma = list.find(',');
+        std::string_view key = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+        while (!key.empty() && key.front() == ' ') key.remove_prefix(1);
+        while (!key.empty() && key.back() == ' ') key.remove_suffix(1);
+        if (key.empty()) continue;
+
+        id_tag t = classify_id_tag(key);
+        if (t == id_tag::unknown) return std::nullopt;
+
+        set |= id_tag_bit(t);
+    }
+
+    return set;
+}
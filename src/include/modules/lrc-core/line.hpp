@@ -1,6 +1,38 @@
 #pragma once
 
+#include <cstddef>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../globals.hpp"
+#include "diagnostics.hpp"
+#include "tag.hpp"
+#include "timestamp.hpp"
+
+void
+append_timestamp (std::string &out, timestamp ts);
 
 std::string
-correct_line_offset (const std::string source, const long offset = 0, bool invert_direction = false);
\ No newline at end of file
+correct_line_offset (
+    std::string_view source,
+    const long offset = 0,
+    bool invert_direction = false,
+    diagnostics &diag = thread_diagnostics(),
+    std::size_t line_number = 0
+);
+
+void
+find_line_spans (std::string_view source, id_tag_set drop, bool timestamps, std::vector<line_span> &spans);
+
+void
+patch_line (
+    std::string_view source,
+    std::span<const line_span> spans,
+    long offset,
+    bool invert_direction,
+    std::string &out,
+    diagnostics &diag = thread_diagnostics(),
+    std::size_t line_number = 0
+);
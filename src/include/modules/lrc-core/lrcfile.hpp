@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../globals.hpp"
+
+/**
+* @brief A whole .lrc file read in one go, with its lines as views.
+*
+* The bytes are read with a single read into one buffer, and lines
+* are found with memchr over it. The BOM and line break characters
+* (\n, \r\n or a lone \r) are left out of the views rather than
+* erased from the data, so nothing is copied line by line.
+*
+* Views stay valid for as long as the lrc_file does, moves included.
+*/
+class lrc_file {
+    private:
+        std::unique_ptr<char[]> bytes;
+        std::size_t length = 0;
+        std::vector<std::string_view> views;
+
+        void
+        index_lines ();
+
+    public:
+        lrc_file () = default;
+        explicit lrc_file (const fs::path &path);
+
+        static lrc_file
+        from_memory (std::string_view contents);
+
+        std::span<const std::string_view>
+        lines () const;
+
+        filelines
+        to_filelines () const;
+};
+
+std::string_view
+strip_lrc_bom (std::string_view data);
+
+void
+split_lrc_line (std::string_view line, std::vector<std::string_view> &lines);
+
+bool
+looks_like_utf16_or_utf32 (std::string_view s);
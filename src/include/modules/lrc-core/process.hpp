@@ -1,13 +1,167 @@
 #pragma once
 
+#include <cstddef>
 #include <filesystem>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "../../globals.hpp"
+#include "diagnostics.hpp"
+#include "idtag.hpp"
+#include "stage.hpp"
+
+/**
+* Everything process_lyrics can be asked to do, already parsed.
+*/
+struct process_options {
+    bool correct_offset = false;        // apply [offset:] to the timestamps
+    std::optional<long> offset_override;// ms, used instead of the file's [offset:]
+    bool invert_offset = false;         // negate the sign of the offset
+    id_tag_set drop = 0;                // ID tags to drop from every line
+    bool header_only = false;           // only look for tags before the first lyric line
+    unsigned threads = 1;               // for run() on big documents, 0 for one per core; 1 with custom stages
+    bool verbatim = false;              // patch timestamps and tags in place, keep every other byte
+    bool expand = false;                // one line per timestamp, in time order
+    bool sort = false;                  // put timed lines in time order
+    bool dedup = false;                 // drop timed lines repeating one already kept
+    double time_scale = 1.0;            // stretch every timestamp by this factor
+    bool collapse = false;              // merge timed lines with the same text
+};
+
+process_options
+parse_process_options (std::string_view options);
+
+/**
+* @brief A set of processing steps, set up once and run on many documents.
+*
+* Options are parsed and checked when the pipeline is built, so
+* running it over a whole library costs no string parsing per file.
+* Every step is a lyric_stage, and all of them run in a single
+* traversal of the document, see stage.hpp.
+* Running it doesn't change it, so a single pipeline can be shared
+* by several threads as long as each one brings its own diagnostics.
+*/
+class lyric_pipeline {
+    private:
+        process_options opts;
+        std::vector<std::shared_ptr<const lyric_stage>> stages;
+        std::size_t custom_at = 0;          // where add_stage inserts, right before pruning
+        std::size_t custom_stages = 0;
+        std::shared_ptr<const correct_offset_stage> corrector;  // null if not correcting
+        std::size_t correct_at = 0;         // where corrector is among the stages
+
+        filelines
+        run_range (
+            std::span<const std::string_view> lines,
+            std::size_t first_line,
+            std::size_t header_end,
+            long offset,
+            diagnostics &diag
+        ) const;
+
+        std::optional<long>
+        last_offset_in (std::span<const std::string_view> lines, std::size_t first_line, std::size_t header_end) const;
+
+        bool
+        scan_tags (std::string_view line, bool past_header) const;
+
+        bool
+        take_line (
+            std::string_view line,
+            std::size_t line_number,
+            bool past_header,
+            long &offset,
+            std::string &out,
+            diagnostics &diag
+        ) const;
+
+        void
+        finish (filelines &out) const;
+
+        friend class lyric_stream;
+
+    public:
+        explicit lyric_pipeline (process_options options = {});
+        explicit lyric_pipeline (std::string_view options);
+
+        const process_options &
+        options () const;
+
+        lyric_pipeline &
+        add_stage (std::shared_ptr<const lyric_stage> stage);
+
+        bool
+        needs_document () const;
+
+        filelines
+        run (const filelines &lyrics, diagnostics &diag = thread_diagnostics()) const;
+
+        filelines
+        run (std::span<const std::string_view> lyrics, diagnostics &diag = thread_diagnostics()) const;
+
+        filelines
+        run (const fs::path &lyrics, diagnostics &diag = thread_diagnostics()) const;
+
+        std::size_t
+        stream (std::istream &in, std::ostream &out, diagnostics &diag = thread_diagnostics()) const;
+
+        bool
+        would_change (std::span<const std::string_view> lyrics) const;
+
+        bool
+        would_change (const filelines &lyrics) const;
+};
+
+// Where a lyric_stream hands each processed line
+using line_sink = std::function<void (std::string_view)>;
+
+/**
+* @brief Push-style counterpart of lyric_pipeline::run.
+*
+* Lines go in one at a time with push, and each one is handed to the
+* sink as soon as it's processed, or not at all if it's dropped.
+* Only the running state is kept, never the document.
+*
+* @code
+* lyric_stream s(pipeline, [](std::string_view line){ std::cout << line << '\n'; });
+* s.push("[offset: 500]");
+* s.push("[00:12.34] Hello");     // written right away, as [00:11.84] Hello
+* @endcode
+*/
+class lyric_stream {
+    private:
+        const lyric_pipeline &pipeline;
+        line_sink sink;
+        diagnostics &diag;
+
+        long offset;
+        std::size_t line_number = 0;
+        std::size_t emitted = 0;
+        bool past_header = false;
+        std::string processed;      // reused line after line
+
+    public:
+        lyric_stream (const lyric_pipeline &pipeline, line_sink sink, diagnostics &diag = thread_diagnostics());
+
+        void
+        push (std::string_view line);
+
+        std::size_t
+        lines_emitted () const;
+};
+
+filelines
+read_lrc_file (const fs::path &lyrics);
 
 filelines
-process_lyrics (const filelines lyrics, const std::string options = "");
+process_lyrics (const filelines &lyrics, const std::string &options = "", diagnostics &diag = thread_diagnostics());
 
 filelines
-process_lyrics (const fs::path lyrics, const std::string options);
\ No newline at end of file
+process_lyrics (const fs::path &lyrics, const std::string &options, diagnostics &diag = thread_diagnostics());
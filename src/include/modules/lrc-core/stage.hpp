@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../../globals.hpp"
+#include "diagnostics.hpp"
+#include "idtag.hpp"
+#include "tag.hpp"
+#include "token.hpp"
+
+/**
+* The timestamps of a staged line as columns, line [mm:ss.xx] and
+* enhanced LRC word <mm:ss.xx> timings alike, in line order. Durations
+* are contiguous, so a stage can correct every one of them with a
+* single apply_offsets call however many words the line has.
+*/
+struct line_timings {
+    std::vector<int64_t> durations;     // ms
+    std::vector<uint32_t> lexemes;      // index of the lexeme each one was read from
+    std::vector<uint8_t> words;         // 1 for a <mm:ss.xx> word timing
+};
+
+/**
+* @brief A line on its way through the stages of a lyric_pipeline.
+*
+* The line is lexed at most once, the first time a stage asks for
+* its lexemes, timings or tags, and every stage reads and rewrites
+* that same representation: timestamps are corrected in the timings
+* and tags are clipped by marking their bytes. The line is only written
+* back once every stage is done with it, see write.
+*/
+class staged_line {
+    public:
+        // What a staged_line works in, reused line after line
+        struct scratch {
+            lexeme_buffer lexemes;
+            line_timings timings;
+            std::vector<tag_view> tags;
+            std::vector<line_span> clips;
+            std::vector<line_span> spans;
+        };
+
+    private:
+        std::string_view line;
+        std::size_t number;
+        bool scan_tags;         // whether the line is looked at for tags at all
+        bool lexed = false;
+        bool tags_read = false;
+        bool retimed = false;   // timestamps are to be written back
+        scratch &buffers;
+
+        void
+        lex ();
+
+    public:
+        staged_line (std::string_view line, std::size_t number, bool scan_tags, scratch &buffers);
+
+        std::string_view
+        source () const;
+
+        std::size_t
+        line_number () const;
+
+        std::span<const lexeme>
+        lexemes ();
+
+        line_timings &
+        timings ();
+
+        std::span<const tag_view>
+        tags ();
+
+        bool
+        clip (const tag_view &t);
+
+        bool
+        is_clipped (const lexeme &l) const;
+
+        void
+        retime ();
+
+        bool
+        blank ();
+
+        void
+        write (std::string &out, bool verbatim);
+};
+
+/**
+* What a stage may change besides the line itself.
+*/
+struct stage_context {
+    long &offset;           // running offset, in ms
+    diagnostics &diag;      // sink for warnings
+};
+
+/**
+* @brief One step of a lyric_pipeline.
+*
+* Every line goes through on_line of every stage, one stage after
+* the other, before the next line is looked at, so however many
+* stages there are, each line is traversed and lexed only once.
+* on_document runs once all the lines are through, for steps like
+* sorting that need the whole document.
+*
+* Stages are shared by every run of a pipeline, threads included,
+* so on_line can't keep state of its own: anything running from one
+* line to the next goes in the stage_context. Pipelines with stages of
+* your own run on a single thread, see lyric_pipeline::add_stage.
+*/
+class lyric_stage {
+    public:
+        virtual
+        ~lyric_stage () = default;
+
+        /**
+        * @brief Work on one line, lines come in document order.
+        *
+        * @return false to drop the line altogether
+        */
+        virtual bool
+        on_line (staged_line &, stage_context &) const { return true; }
+
+        /**
+        * @brief Work on the output once every line went through.
+        */
+        virtual void
+        on_document (filelines &) const {}
+
+        /**
+        * @brief Tell if on_document needs the whole document, so
+        * lines can't be written as soon as they're processed.
+        */
+        virtual bool
+        needs_document () const { return false; }
+};
+
+// Reads [offset:] into the running offset, and clips it
+class offset_stage : public lyric_stage {
+    private:
+        bool overridden;    // the running offset is forced, tags don't change it
+
+    public:
+        explicit offset_stage (bool overridden = false);
+
+        bool
+        on_line (staged_line &line, stage_context &ctx) const override;
+};
+
+// Clips every ID tag in the set
+class drop_stage : public lyric_stage {
+    private:
+        id_tag_set drop;
+
+    public:
+        explicit drop_stage (id_tag_set drop);
+
+        bool
+        on_line (staged_line &line, stage_context &ctx) const override;
+};
+
+// Applies the running offset to every timestamp
+class correct_offset_stage : public lyric_stage {
+    private:
+        bool invert;
+
+    public:
+        explicit correct_offset_stage (bool invert_direction = false);
+
+        bool
+        on_line (staged_line &line, stage_context &ctx) const override;
+
+        void
+        on_lines (std::span<staged_line> lines, std::span<const long> offsets, diagnostics &diag) const;
+};
+
+// Stretches every timestamp by a factor, like for a sped up track
+class time_scale_stage : public lyric_stage {
+    private:
+        double factor;
+
+    public:
+        explicit time_scale_stage (double factor);
+
+        bool
+        on_line (staged_line &line, stage_context &ctx) const override;
+};
+
+// Drops lines with nothing left in them
+class prune_stage : public lyric_stage {
+    public:
+        bool
+        on_line (staged_line &line, stage_context &ctx) const override;
+};
+
+// Puts timed lines in time order
+class sort_stage : public lyric_stage {
+    public:
+        void
+        on_document (filelines &lines) const override;
+
+        bool
+        needs_document () const override { return true; }
+};
+
+// Splits lines with several timestamps into one line each, in time order
+class expand_stage : public lyric_stage {
+    public:
+        void
+        on_document (filelines &lines) const override;
+
+        bool
+        needs_document () const override { return true; }
+};
+
+// Merges timed lines with the same text into one with every timestamp
+class collapse_stage : public lyric_stage {
+    public:
+        void
+        on_document (filelines &lines) const override;
+
+        bool
+        needs_document () const override { return true; }
+};
+
+// Drops timed lines that repeat one already kept
+class dedup_stage : public lyric_stage {
+    public:
+        void
+        on_document (filelines &lines) const override;
+
+        bool
+        needs_document () const override { return true; }
+};
+
+// Time of the lines before the first timed one, before any timestamp
+inline constexpr int64_t timeline_start = std::numeric_limits<int64_t>::min();
+
+/**
+* A line of a document on its timeline, see sort_timeline.
+*/
+struct timeline_entry {
+    int64_t time;       // ms, timeline_start for lines before the first timed one
+    uint32_t line;      // index of the line in the document
+    uint32_t stamp;     // which of its leading timestamps this is
+};
+
+void
+sort_timeline (std::vector<timeline_entry> &entries);
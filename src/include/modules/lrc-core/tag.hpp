@@ -1,18 +1,73 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "idtag.hpp"
+#include "token.hpp"
+
 struct tag {
     std::string name;
     std::string value;
 };
 
+/**
+* A tag that points back into the line it was read from.
+*/
+struct tag_view {
+    std::string_view name;
+    std::string_view value;
+    std::size_t begin = 0;  // offset of the opening bracket
+    std::size_t end = 0;    // one past the closing bracket
+};
+
+/**
+* A run of bytes of a line to rewrite, see patch_line.
+*/
+struct line_span {
+    std::size_t begin = 0;  // offset of the first byte
+    std::size_t end = 0;    // one past the last one
+    bool drop = false;      // a tag to clip out, otherwise a timestamp
+    int64_t duration = 0;   // the timestamp, in ms
+    bool rounded = false;   // the timestamp had to be rounded up
+};
+
 std::vector<tag>
 read_tags_from_line (const std::string_view source);
 
+void
+read_tags_from_line (std::string_view source, std::vector<tag_view> &tags);
+
+void
+read_tags_from_lexemes (std::string_view source, std::span<const lexeme> lexemes, std::vector<tag_view> &tags);
+
 tag
 slice_at_character (const std::string_view source, char joint = ' ');
 
 std::string
-pop_tag (std::string source, std::string key);
\ No newline at end of file
+pop_tag (std::string source, std::string key);
+
+std::string
+drop_tags (std::string_view source, id_tag_set tags);
+
+const tag_view *
+find_offset_tag (std::span<const tag_view> tags);
+
+bool
+is_offset_value (std::string_view value);
+
+bool
+might_have_tags (std::string_view source);
+
+bool
+starts_with_timestamp (std::string_view line);
+
+std::size_t
+find_header_end (std::span<const std::string> lines);
+
+std::size_t
+find_header_end (std::span<const std::string_view> lines);
@@ -1,7 +1,15 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "charclass.hpp"
+#include "diagnostics.hpp"
 
 /**
 * Just as a representation helper, this is not
@@ -14,37 +22,522 @@ struct ts_components {
     unsigned long cs;
 };
 
+/**
+* Outcome of scanning a string as a timestamp, in the
+* spirit of std::from_chars.
+*/
+enum class ts_errc {
+    ok,             // well formed mm:ss.cs
+    rounded,        // parsed, but ss >= 60 or cs >= 100
+    not_a_timestamp
+};
+
+struct ts_result {
+    int64_t duration;
+    ts_errc ec;
+};
+
+/**
+* A run of timestamps, by index, sharing the same offset.
+*/
+struct offset_range {
+    std::size_t begin;
+    std::size_t end;    // one past the last timestamp
+    long offset;
+};
+
+/*
+* Everything in here is plain arithmetic over string views, so the
+* timestamp type and its parsers are constexpr and can be folded
+* at compile time, e.g. "01:23.45"_ts.
+*/
+
 class timestamp {
     private:
         int64_t duration;
 
     public:
-        timestamp(int64_t duration = 0);
-        timestamp(ts_components ts);
+        enum format_flags : unsigned {
+            format_default    = 0,
+            format_no_filling = 1 << 0   // don't pad components to two digits
+        };
+
+        // Worst case length written by write_to, sign included
+        static constexpr std::size_t max_chars = 24;
+
+        // Construct a timestamp from an already-ms length
+        constexpr timestamp(int64_t duration = 0) : duration(duration) {}
+        constexpr timestamp(ts_components ts);
         timestamp(std::string source, bool disable_warning = false);
-        timestamp(std::string_view source, bool disable_warning = false);
+        constexpr timestamp(std::string_view source, bool disable_warning = false);
 
-        long
-        as_ms() const;
+        /**
+        * @brief Return timestamp as a milliseconds length.
+        */
+        constexpr int64_t
+        as_ms() const { return this->duration; }
 
         std::string
         as_string (bool no_filling = false) const;
 
-        ts_components
+        constexpr char *
+        write_to (char *out, format_flags flags = format_default) const;
+
+        constexpr ts_components
         as_tsmap (bool zero_negative_timestamps = false) const;
 
-        timestamp &
+        constexpr timestamp &
         apply_offset (const long offset = 0, bool invert_direction = false);
 };
 
-int64_t
+constexpr ts_result
+scan_timestamp (std::string_view source);
+
+constexpr ts_result
+scan_timestamp_generic (std::string_view source);
+
+constexpr ts_result
+scan_canonical_timestamp (std::string_view source);
+
+constexpr std::optional<int64_t>
+try_parse_timestamp (std::string_view source, bool disable_warning = false);
+
+constexpr int64_t
 parse_timestamp (std::string_view source, bool disable_warning = false);
 
-bool
+constexpr bool
 is_it_a_timestamp (const std::string_view source);
 
+void
+warn_rounded_timestamp (
+    std::string_view source,
+    int64_t duration,
+    diagnostics &diag = thread_diagnostics(),
+    std::size_t line = 0,
+    std::size_t column = 0
+);
+
+void
+apply_offsets (std::span<int64_t> durations, long offset, bool invert_direction = false);
+
+void
+apply_offsets (std::span<int64_t> durations, std::span<const offset_range> ranges, bool invert_direction = false);
+
 bool
 is_numeric_only (const std::string_view source);
 
 long
-to_long(std::string_view sv);
\ No newline at end of file
+to_long(std::string_view sv);
+
+namespace timestamp_literals {
+    consteval timestamp
+    operator""_ts (const char *source, std::size_t length);
+}
+
+/* ---------- parsing ---------- */
+
+/**
+* @brief Validate and parse any timestamp shape in a single scan.
+*
+* Accepts [-]mm:ss.cs where every component is a non-empty run of
+* digits. Nothing is allocated and every byte is visited once, so
+* this is what every other timestamp reader builds upon.
+*
+* @code
+* // returns {12340, ts_errc::ok}
+* ts_result r = scan_timestamp("00:12.34");
+*
+* // returns {75000, ts_errc::rounded}
+* ts_result r = scan_timestamp("00:75.00");
+*
+* // returns {0, ts_errc::not_a_timestamp}
+* ts_result r = scan_timestamp("drugs");
+* @endcode
+*
+* @note scan_timestamp takes a shortcut for the canonical mm:ss.cs
+* shape and only falls back to this for everything else.
+*
+* @return the duration in ms and whether the source was well formed,
+* had to be rounded up or isn't a timestamp at all.
+*/
+constexpr ts_result
+scan_timestamp_generic (std::string_view source)
+{
+    constexpr ts_result rejected = {0, ts_errc::not_a_timestamp};
+
+    // long enough for any sane timestamp, short enough to never overflow
+    constexpr long max_component_digits = 9;
+
+    const char *cursor = source.data();
+    const char *end = cursor + source.size();
+
+    bool is_negative = cursor != end && *cursor == '-';
+    if (is_negative) cursor++;
+
+    // mm, ss and cs, each one followed by its separator
+    int64_t components[3] = {0, 0, 0};
+    constexpr char separators[3] = {':', '.', '\0'};
+
+    for (int i = 0; i < 3; i++) {
+        const char *run = cursor;
+
+        while (
+            cursor != end
+        &&  is_char(*cursor, cc_digit)
+        &&  cursor - run < max_component_digits
+        ) {
+            components[i] = components[i] * 10 + (*cursor - '0');
+            cursor++;
+        }
+
+        // empty components are not allowed
+        if (cursor == run) return rejected;
+
+        if (i < 2) {
+            if (cursor == end || *cursor != separators[i]) return rejected;
+            cursor++;
+        }
+    }
+
+    // trailing garbage, including an overlong centiseconds run
+    if (cursor != end) return rejected;
+
+    int64_t duration = (components[0] * 60000)
+                    +  (components[1] * 1000)
+                    +  (components[2] * 10);
+
+    return {
+        duration * (is_negative ? -1 : 1),
+        (components[1] >= 60 || components[2] >= 100) ? ts_errc::rounded : ts_errc::ok
+    };
+}
+
+/**
+* @brief Scan a canonical 8-byte mm:ss.cs timestamp as a single word.
+*
+* This is the shape timestamp::as_string emits and what nearly every
+* file in the wild uses, so it's worth a SWAR (SIMD within a register)
+* path: the layout is validated with a handful of masks and the value
+* is computed without branching on the contents.
+*
+* @return {0, ts_errc::not_a_timestamp} for anything that is not
+* exactly dd:dd.dd, even if scan_timestamp_generic would accept it.
+*/
+constexpr ts_result
+scan_canonical_timestamp (std::string_view source)
+{
+    if (source.size() != 8) return {0, ts_errc::not_a_timestamp};
+
+    // Assembled byte by byte so the first char is always the lowest
+    // byte regardless of endianness; compilers fold this into one load
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++)
+        word |= uint64_t(static_cast<unsigned char>(source[i])) << (8 * i);
+
+    // bytes 2 and 5 are the separators, the rest are digits
+    constexpr uint64_t separator_mask = 0x0000FF0000FF0000ULL;
+    constexpr uint64_t separator_bytes = (uint64_t(':') << 16) | (uint64_t('.') << 40);
+    constexpr uint64_t digit_mask = ~separator_mask;
+
+    // '0'..'9' become 0x00..0x09; a byte is a digit only if neither it
+    // nor it plus 6 reaches the high nibble
+    uint64_t values = word ^ 0x3030303030303030ULL;
+    uint64_t non_digits = (values | (values + 0x0606060606060606ULL))
+                        & 0xF0F0F0F0F0F0F0F0ULL & digit_mask;
+
+    bool is_canonical = ((word & separator_mask) == separator_bytes) && non_digits == 0;
+
+    // Fold each tens digit with the unit digit right after it, so
+    // bytes 0, 3 and 6 end up holding mm, ss and cs
+    uint64_t digits = values & digit_mask;
+    uint64_t pairs = digits * 10 + (digits >> 8);
+
+    int64_t mm = pairs & 0xFF;
+    int64_t ss = (pairs >> 24) & 0xFF;
+    int64_t cs = (pairs >> 48) & 0xFF;
+
+    int64_t duration = (mm * 60000) + (ss * 1000) + (cs * 10);
+
+    // cs can't go over 99 with two digits, but ss can
+    ts_errc ec = (ss >= 60) ? ts_errc::rounded : ts_errc::ok;
+
+    return {
+        is_canonical ? duration : 0,
+        is_canonical ? ec : ts_errc::not_a_timestamp
+    };
+}
+
+/**
+* @brief Validate and parse a timestamp in a single scan.
+*
+* Anything not starting with a digit or a minus sign is rejected
+* right away. Canonical mm:ss.cs timestamps take the SWAR path, odd
+* widths, negatives and mm:ss.xxx go through scan_timestamp_generic.
+*/
+constexpr ts_result
+scan_timestamp (std::string_view source)
+{
+    // Plain words are turned away on their very first byte
+    if (source.empty() || !is_char(source[0], cc_timestamp_head))
+        return {0, ts_errc::not_a_timestamp};
+
+    if (source.size() == 8) {
+        ts_result canonical = scan_canonical_timestamp(source);
+        if (canonical.ec != ts_errc::not_a_timestamp) return canonical;
+    }
+
+    return scan_timestamp_generic(source);
+}
+
+/**
+* @brief Parse a timestamp, or nothing if the source isn't one.
+*
+* Everybody could make mistakes with formatting so this is
+* forgiving: out of range seconds or centiseconds are carried
+* over to the bigger units, warning the user about it.
+*
+* @code
+* // returns 754560
+* std::optional<int64_t> ms = try_parse_timestamp("12:34.56");
+*
+* // returns std::nullopt
+* std::optional<int64_t> ms = try_parse_timestamp("banana");
+* @endcode
+*/
+constexpr std::optional<int64_t>
+try_parse_timestamp (std::string_view source, bool disable_warning)
+{
+    auto [duration, ec] = scan_timestamp(source);
+
+    if (ec == ts_errc::not_a_timestamp) return std::nullopt;
+
+    // Trigger a warning if a roundtrip had to be performed, into
+    // the thread's sink; there's nobody to warn at compile time
+    if (ec == ts_errc::rounded && !disable_warning && !std::is_constant_evaluated())
+        warn_rounded_timestamp(source, duration);
+
+    return duration;
+}
+
+/**
+* @brief Parse a timestamp string to milliseconds.
+*
+* @code
+* // returns 100
+* int64_t ms = parse_timestamp("00:00.10");
+* @endcode
+*
+* @return the duration of the timestamp, or 0 if the source
+* is not a timestamp at all.
+*/
+constexpr int64_t
+parse_timestamp (std::string_view source, bool disable_warning)
+{
+    return try_parse_timestamp(source, disable_warning).value_or(0);
+}
+
+/**
+* @brief Check if a given string is an mm:ss.ms timestamp
+*
+* Ensure that all the chacarters of the string are actually a timestamp representation,
+* that is, digits separated by exactly one : and then one . in that order.
+* The first char is allowed to be a minus sign.
+*/
+constexpr bool
+is_it_a_timestamp (const std::string_view source)
+{
+    return scan_timestamp(source).ec != ts_errc::not_a_timestamp;
+}
+
+/* ---------- timestamp ---------- */
+
+/**
+* @brief Construct a timestamp from its components.
+*/
+constexpr
+timestamp::timestamp (ts_components ts)
+    : duration(
+        int64_t((ts.mm * 60000) + (ts.ss * 1000) + (ts.cs * 10))
+        * (ts.is_negative ? -1 : 1)
+    )
+{}
+
+/**
+* @brief Construct a timestamp from a string by
+* separating the timestamp in mm:ss.cs
+* to mm, ss, ms format.
+*
+* @param source timestamp to be split.
+*
+* @code
+* // returns mm = 0, ss = 0, ms = 100
+* ts_components ts = timestamp("00:00.10").as_tsmap();
+*
+* // returns mm = 12, ss = 34, ms = 560
+* ts_components ts = timestamp("12:34.56").as_tsmap();
+* @endcode
+*/
+constexpr
+timestamp::timestamp (std::string_view source, bool disable_warning)
+    : duration(parse_timestamp(source, disable_warning))
+{}
+
+/**
+* @brief Return the timestamp as a timestamp map form.
+*
+* @code
+* // returns mm = 0, ss = 0, ms = 100
+* ts_components ts = divide_timestamp("00:00.10");
+*
+* // returns mm = 12, ss = 34, ms = 560
+* ts_components ts = divide_timestamp("12:34.56");
+* @endcode
+*
+* @param zero_negative_timestamp clamp all negative timestamps
+* to zero
+*
+* @return the source timestamp as a struct with
+* mm, ss and cs members representing the timestamp
+*/
+constexpr ts_components
+timestamp::as_tsmap (bool zero_negative_timestamps) const
+{
+    ts_components ts = {false, 0, 0, 0};
+    int64_t remaining_ms = this->duration;
+    if (remaining_ms < 0) {
+        // Round negative timestamps up to zero if needed
+        if (!zero_negative_timestamps) {
+            remaining_ms *= -1;
+            ts.is_negative = true;
+        } else
+            // just return a zeroed timestamp, no need to
+            // manually convert
+            return ts;
+    }
+
+    // Progressive reduction, bigger units first
+
+    ts.mm = remaining_ms / 60000; remaining_ms -= ts.mm * 60000;
+    ts.ss = remaining_ms / 1000; remaining_ms -= ts.ss * 1000;
+    ts.cs = remaining_ms / 10;
+
+    return ts;
+}
+
+// "00" to "99", two chars per entry
+inline constexpr char ts_two_digit_table[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+constexpr char *
+write_ts_component (char *out, unsigned long value, bool no_filling)
+{
+    // Minutes are the only component that can go past two digits.
+    // Those are written by hand, last digit first, since to_chars
+    // isn't constexpr in C++20
+    if (value >= 100) {
+        int length = 0;
+        for (unsigned long rest = value; rest > 0; rest /= 10) length++;
+
+        for (int i = length - 1; i >= 0; i--, value /= 10)
+            out[i] = char('0' + value % 10);
+
+        return out + length;
+    }
+
+    if (value < 10 && no_filling) {
+        *out++ = char('0' + value);
+        return out;
+    }
+
+    *out++ = ts_two_digit_table[value * 2];
+    *out++ = ts_two_digit_table[value * 2 + 1];
+    return out;
+}
+
+/**
+* @brief Write the timestamp as mm:ss.cs into a caller provided buffer.
+*
+* Returns like std::to_chars does, without using it: nothing is
+* allocated nor null terminated, and the returned pointer is one past
+* the last char written. Two-digit components come from a lookup
+* table, and minutes past 99 from a plain digit loop.
+*
+* @code
+* char buffer[timestamp::max_chars];
+* char *end = timestamp(754560).write_to(buffer);
+* // std::string_view(buffer, end - buffer) == "12:34.56"
+* @endcode
+*
+* @param out buffer with room for at least timestamp::max_chars chars
+* @param flags format_no_filling to skip the two-digit padding
+*/
+constexpr char *
+timestamp::write_to (char *out, format_flags flags) const
+{
+    ts_components ts = this->as_tsmap();
+    bool no_filling = flags & format_no_filling;
+
+    if (this->duration < 0) *out++ = '-';
+
+    out = write_ts_component(out, ts.mm, no_filling);
+    *out++ = ':';
+    out = write_ts_component(out, ts.ss, no_filling);
+    *out++ = '.';
+    out = write_ts_component(out, ts.cs, no_filling);
+
+    return out;
+}
+
+/**
+* @brief Apply an offset, expressed in milliseconds, to a timestamp.
+*
+* By default, a negative integer delays the timestamp and vice versa
+* according to most implementations in the wild, as if a negative
+* value meant "this is X milliseconds behind where it's supposed
+* to be".
+*
+* You can invert this behavior by setting invert_direction to true,
+* so it fits with the analogy of a positive number meaning "this
+* is intended to be shown X milliseconds later".
+* @code
+* // returns "00:13.00"
+* std::string ts = apply_offset_to_timestamp("00:12.33", -670");
+* @endcode
+*
+* @param source the timestamp to be corrected
+* @param offset offset value, expressed in milliseconds
+* @param invert_direction negate the sign of the offset
+*/
+constexpr timestamp &
+timestamp::apply_offset (const long offset, bool invert_direction)
+{
+    this->duration -= (offset * (invert_direction ? -1 : 1));
+
+    // prevent from going below zero
+    if (this->duration <= 0) this->duration = 0;
+
+    return *this;
+}
+
+/* ---------- literals ---------- */
+
+/**
+* @brief Fold a well formed timestamp literal at compile time.
+*
+* Malformed or out of range literals don't compile at all.
+*
+* @code
+* using namespace timestamp_literals;
+* static_assert(("01:23.45"_ts).as_ms() == 83450);
+* @endcode
+*/
+consteval timestamp
+timestamp_literals::operator""_ts (const char *source, std::size_t length)
+{
+    ts_result ts = scan_timestamp(std::string_view(source, length));
+
+    if (ts.ec != ts_errc::ok)
+        throw "not a well formed mm:ss.cs timestamp literal";
+
+    return timestamp(ts.duration);
+}
@@ -1,16 +1,83 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// Caller-owned storage for tokens, reuse it to avoid reallocating
+using token_buffer = std::vector<std::string_view>;
+
 std::vector<std::string_view>
 tokenize_line (const std::string_view source, bool treat_as_lyrics_line = false);
 
+void
+tokenize_line (const std::string_view source, token_buffer &tokens, bool treat_as_lyrics_line = false);
+
+// What a token is, as far as joints are concerned
+enum class token_kind : unsigned char {
+    text,
+    tag_open,   // [ <
+    tag_close,  // ] >
+    colon
+};
+
+// What a lexeme is within a lyric line
+enum class lexeme_kind : unsigned char {
+    text,           // lyrics, outside of any tag
+    bracket_open,   // [
+    bracket_close,  // ]
+    angle_open,     // <
+    angle_close,    // >
+    colon,          // a lone :
+    timestamp,      // mm:ss.cs, wherever it is
+    tag_key,        // inside a tag, up to its first colon
+    tag_value       // inside a tag, after its first colon
+};
+
+/**
+* A token that already knows what it is.
+*/
+struct lexeme {
+    lexeme_kind kind;
+    std::string_view view;      // exactly as tokenize_line cuts it
+    int64_t duration = 0;       // timestamps only, parsed value in ms
+    bool rounded = false;       // timestamps only, see ts_errc::rounded
+
+    // Where the tag's key/value colon is within view, if it's there
+    std::size_t colon = std::string_view::npos;
+};
+
+using lexeme_buffer = std::vector<lexeme>;
+
+void
+lex_line (std::string_view source, lexeme_buffer &lexemes);
+
+token_kind
+classify_token (std::string_view token);
+
+token_kind
+joint_kind_of (lexeme_kind kind);
+
+bool
+needs_joint (std::string_view previous, std::string_view current, bool treat_as_lyrics_line = false);
+
+bool
+needs_joint (const lexeme &previous, const lexeme &current);
+
 std::string
-serialize_tokens (const std::vector<std::string_view> token_vector, std::string_view joint = " ", bool treat_as_lyrics_line = false);
+serialize_tokens (const std::vector<std::string_view> &token_vector, std::string_view joint = " ", bool treat_as_lyrics_line = false);
 
 std::string
 serialize_tokens (const std::vector<std::string>& token_vector, std::string_view joint = " ", bool treat_as_lyrics_line = false);
 
 std::string
-trim_string (const std::string source);
\ No newline at end of file
+serialize_tokens (std::span<const lexeme> lexemes, std::string_view joint = " ");
+
+std::string_view
+trim_view (std::string_view source);
+
+std::string
+trim_string (std::string_view source);
\ No newline at end of file
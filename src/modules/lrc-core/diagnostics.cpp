@@ -0,0 +1,160 @@
+/**
+* @file diagnostics.cpp
+* @brief Collect warnings while processing and report them once.
+*
+* @par thread_diagnostics().report(diag_code::rounded_timestamp, 3, 2, "...");
+* @par thread_diagnostics().flush(std::cerr);
+*/
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "diagnostics.hpp"
+
+static std::string_view
+code_name (diag_code code)
+{
+    switch (code) {
+        case diag_code::rounded_timestamp: return "rounded timestamp";
+        case diag_code::bad_offset_value:  return "bad offset value";
+        default:                           return "unknown";
+    }
+}
+
+diagnostics::diagnostics (std::size_t max_repeats)
+    : max_repeats(max_repeats)
+{}
+
+/**
+* @brief Record a warning found at the given line and column.
+*
+* Past max_repeats warnings of the same code, only the count grows.
+*/
+void
+diagnostics::report (diag_code code, std::size_t line, std::size_t column, std::string message)
+{
+    std::size_t &seen = this->counts[std::size_t(code)];
+
+    if (seen++ < this->max_repeats)
+        this->kept.push_back({code, line, column, std::move(message)});
+}
+
+std::size_t
+diagnostics::count (diag_code code) const
+{
+    return this->counts[std::size_t(code)];
+}
+
+std::size_t
+diagnostics::total () const
+{
+    std::size_t all = 0;
+    for (std::size_t c : this->counts) all += c;
+    return all;
+}
+
+const std::vector<diagnostic> &
+diagnostics::entries () const
+{
+    return this->kept;
+}
+
+/**
+* @brief Format every kept warning plus the count of the omitted ones.
+*
+* @code
+* // warning: line 3, column 2: 00:75.00 timestamp is malformed; will round up to 01:15.00...
+* // warning: 40 more rounded timestamp warnings omitted
+* @endcode
+*/
+std::string
+diagnostics::summary () const
+{
+    std::string out;
+
+    // Reported in processing order, shown in file order
+    std::vector<diagnostic> sorted = this->kept;
+    std::stable_sort(sorted.begin(), sorted.end(),
+        [](const diagnostic &a, const diagnostic &b){ return a.line < b.line; });
+
+    for (const diagnostic &d : sorted) {
+        out += "warning: ";
+        if (d.line != 0) out += "line " + std::to_string(d.line);
+        if (d.line != 0 && d.column != 0) out += ", column " + std::to_string(d.column);
+        if (d.line != 0) out += ": ";
+        out += d.message;
+        out += '\n';
+    }
+
+    for (std::size_t c = 0; c < this->counts.size(); c++) {
+        if (this->counts[c] <= this->max_repeats) continue;
+
+        out += "warning: " + std::to_string(this->counts[c] - this->max_repeats)
+            +  " more " + std::string(code_name(diag_code(c))) + " warnings omitted\n";
+    }
+
+    return out;
+}
+
+/**
+* @brief Write the summary in one go and start over.
+*/
+void
+diagnostics::flush (std::ostream &out)
+{
+    if (this->total() == 0) return;
+
+    out << this->summary() << std::flush;
+    this->clear();
+}
+
+void
+diagnostics::clear ()
+{
+    this->kept.clear();
+    this->counts = {};
+}
+
+std::size_t
+diagnostics::repeat_limit () const
+{
+    return this->max_repeats;
+}
+
+/**
+* @brief Append what another sink found after everything found here.
+*
+* Meant for work split in chunks: give each chunk its own sink with
+* the same repeat limit, then merge them in document order. What's
+* kept is exactly what a single sink would have kept.
+*/
+void
+diagnostics::merge (const diagnostics &later)
+{
+    std::array<std::size_t, std::size_t(diag_code::count)> taken = {};
+
+    for (const diagnostic &d : later.kept) {
+        std::size_t c = std::size_t(d.code);
+
+        if (this->counts[c] + taken[c]++ < this->max_repeats)
+            this->kept.push_back(d);
+    }
+
+    for (std::size_t c = 0; c < this->counts.size(); c++)
+        this->counts[c] += later.counts[c];
+}
+
+/**
+* @brief The calling thread's own sink.
+*
+* Used whenever no sink is passed explicitly, so threads never
+* interleave their warnings.
+*/
+diagnostics &
+thread_diagnostics ()
+{
+    thread_local diagnostics sink;
+    return sink;
+}
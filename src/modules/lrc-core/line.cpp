@@ -8,13 +8,34 @@
 * @par apply_offset_to_timestamp("00:12.33", -670");
 */
 
+#include <algorithm>
+#include <cstring>
+#include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "diagnostics.hpp"
 #include "line.hpp"
+#include "stage.hpp"
+#include "tag.hpp"
 #include "timestamp.hpp"
 #include "token.hpp"
 
+/**
+* @brief Write a timestamp right at the end of an output line.
+*/
+void
+append_timestamp (std::string &out, timestamp ts)
+{
+    size_t at = out.size();
+    out.resize(at + timestamp::max_chars);
+
+    char *end = ts.write_to(out.data() + at);
+
+    out.resize(end - out.data());
+}
+
 /**
 * @brief Correct all the timestamps present in the line
 * by applying an offset.
@@ -35,29 +56,184 @@
 * @param source the line whose timestamps need to be corrected
 * @param offset offset time, expressed in milliseconds
 * @param invert_direction negate the sign of the offset
+* @param diag sink for malformed timestamp warnings
+* @param line_number source line number, for the warnings; 0 if unknown
 */
 std::string
-correct_line_offset (const std::string source, const long offset, bool invert_direction)
+correct_line_offset (
+    std::string_view source,
+    const long offset,
+    bool invert_direction,
+    diagnostics &diag,
+    std::size_t line_number
+)
 {
     // We will overwrite on the fly and probably
     // we will accidentally format the line.
 
-    std::vector<std::string_view> line_tokens_views = tokenize_line(source, true);
+    // Reused line after line, so steady-state lexing doesn't allocate
+    thread_local lexeme_buffer lexemes;
+
+    lexemes.clear();
+    lex_line(source, lexemes);
+
+    // Serialize right here instead of collecting corrected tokens,
+    // so timestamps get written straight into the output line
+    std::string out;
+    out.reserve(source.size() + timestamp::max_chars);
 
-    std::vector<std::string> output_line_tokens;
-    
-    for (std::string_view token : line_tokens_views) {
-        if (!is_it_a_timestamp(token)) {
-            output_line_tokens.emplace_back(token);
+    for (size_t i = 0; i < lexemes.size(); i++) {
+        const lexeme &l = lexemes[i];
+
+        if (i > 0 && needs_joint(lexemes[i - 1], l))
+            out += ' ';
+
+        // the lexer already parsed it
+        if (l.kind != lexeme_kind::timestamp) {
+            out.append(l.view);
             continue;
-        };
+        }
+
+        if (l.rounded)
+            warn_rounded_timestamp(l.view, l.duration, diag, line_number, l.view.data() - source.data() + 1);
+
+        append_timestamp(out, timestamp(l.duration).apply_offset(offset, invert_direction));
+    }
+
+    return out;
+}
+
+/**
+* @brief Find the byte spans of a line that a patch has to rewrite.
+*
+* The line is staged once for both kinds of spans: the ID tags in the
+* set, clipped by a drop_stage just like a pipeline does, and the
+* timestamps left outside of them, as they were read. Spans come out
+* in line order and never overlap, the way staged_line::write hands
+* them to patch_line in verbatim mode.
+*
+* @code
+* // {0, 10, drop}, {11, 19, timestamp 1000 ms}
+* find_line_spans("[ti: Ella] 00:01.00", id_tag_bit(id_tag::title), true, spans);
+* @endcode
+*
+* @param source the lyric line, offsets are relative to it
+* @param drop ID tags to clip out
+* @param timestamps whether timestamps are wanted at all
+* @param spans where spans are appended, clear it to reuse it
+*/
+void
+find_line_spans (std::string_view source, id_tag_set drop, bool timestamps, std::vector<line_span> &spans)
+{
+    if (!timestamps && (drop == 0 || !might_have_tags(source))) return;
+
+    // Reused line after line, so steady-state lexing doesn't allocate
+    thread_local staged_line::scratch buffers;
+
+    long offset = 0;
+    stage_context ctx = {offset, thread_diagnostics()};
+    staged_line line(source, 0, drop != 0, buffers);
+
+    if (drop) drop_stage(drop).on_line(line, ctx);
+
+    std::vector<line_span> &clips = buffers.clips;
+    std::sort(clips.begin(), clips.end(), [](const line_span &a, const line_span &b) { return a.begin < b.begin; });
+
+    auto clip = clips.begin();
+
+    if (timestamps) {
+        std::span<const lexeme> lexemes = line.lexemes();
+
+        for (uint32_t i : line.timings().lexemes) {
+            const lexeme &l = lexemes[i];
+            if (line.is_clipped(l)) continue;
+
+            std::size_t begin = l.view.data() - source.data();
+
+            for (; clip != clips.end() && clip->begin < begin; clip++) spans.push_back(*clip);
+            spans.push_back({begin, begin + l.view.size(), false, l.duration, l.rounded});
+        }
+    }
+
+    spans.insert(spans.end(), clip, clips.end());
+}
+
+/*
+* The usual case of patch_line: nothing to clip and every corrected
+* timestamp as wide as the original, so out is source with a few
+* bytes overwritten. Returns false, leaving out half-written, as soon
+* as that isn't the case.
+*/
+static bool
+patch_in_place (std::string_view source, std::span<const line_span> spans, long offset, bool invert_direction, std::string &out)
+{
+    out.assign(source);
+
+    for (const line_span &s : spans) {
+        if (s.drop) return false;
+
+        char buffer[timestamp::max_chars];
+        char *end = timestamp(s.duration).apply_offset(offset, invert_direction).write_to(buffer);
+
+        if (std::size_t(end - buffer) != s.end - s.begin) return false;
+
+        std::memcpy(out.data() + s.begin, buffer, s.end - s.begin);
+    }
+
+    return true;
+}
+
+/**
+* @brief Rewrite only the given spans of a line, keeping every other
+* byte as it was.
+*
+* Unlike correct_line_offset, the line isn't rebuilt
+* from its tokens, so its spacing survives untouched: timestamp spans
+* are corrected by the offset, and tag spans are clipped out along
+* with nothing else.
+*
+* @code
+* // "[00:08.59]I think  <- two spaces"
+* patch_line("[00:09.59]I think  <- two spaces", {{0, 10, false, 9590}}, 1000, false, out);
+* @endcode
+*
+* @param source the line the spans were found in
+* @param spans what to rewrite, in line order, see find_line_spans
+* @param offset offset time, expressed in milliseconds
+* @param invert_direction negate the sign of the offset
+* @param out the patched line, reused as is
+* @param diag sink for malformed timestamp warnings
+* @param line_number source line number, for the warnings; 0 if unknown
+*/
+void
+patch_line (
+    std::string_view source,
+    std::span<const line_span> spans,
+    long offset,
+    bool invert_direction,
+    std::string &out,
+    diagnostics &diag,
+    std::size_t line_number
+)
+{
+    for (const line_span &s : spans)
+        if (!s.drop && s.rounded)
+            warn_rounded_timestamp(source.substr(s.begin, s.end - s.begin), s.duration, diag, line_number, s.begin + 1);
+
+    if (patch_in_place(source, spans, offset, invert_direction, out)) return;
+
+    // Spans change the length, copy around them
+    out.clear();
+    out.reserve(source.size() + timestamp::max_chars);
+
+    std::size_t copied = 0;
+
+    for (const line_span &s : spans) {
+        out.append(source.substr(copied, s.begin - copied));
+        copied = s.end;
 
-        output_line_tokens.emplace_back(
-            timestamp(token)
-                .apply_offset(offset, invert_direction)
-                .as_string()
-        );
+        if (!s.drop) append_timestamp(out, timestamp(s.duration).apply_offset(offset, invert_direction));
     }
 
-    return serialize_tokens(output_line_tokens, " ", true);
-}
\ No newline at end of file
+    out.append(source.substr(copied));
+}
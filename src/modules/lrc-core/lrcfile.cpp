@@ -0,0 +1,148 @@
+/**
+* @file lrcfile.cpp
+* @brief Read .lrc files into a single buffer and index their lines.
+*
+* @par lrc_file("lyrics.lrc").lines();
+*/
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "lrcfile.hpp"
+
+/**
+* @brief Read the whole file at once.
+*
+* A file that can't be opened reads as an empty one.
+*
+* @throw std::runtime_error if the file looks like UTF-16/32
+*/
+lrc_file::lrc_file (const fs::path &path)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+
+    if (!in.is_open()) return;
+
+    std::streamoff size = in.tellg();
+    if (size <= 0) return;
+
+    this->bytes = std::make_unique<char[]>(size);
+    in.seekg(0);
+    in.read(this->bytes.get(), size);
+    this->length = in.gcount();
+
+    this->index_lines();
+}
+
+/**
+* @brief Take lyrics that are already in memory, copied once.
+*
+* @throw std::runtime_error if the contents look like UTF-16/32
+*/
+lrc_file
+lrc_file::from_memory (std::string_view contents)
+{
+    lrc_file file;
+
+    file.bytes = std::make_unique<char[]>(contents.size());
+    file.length = contents.size();
+    std::memcpy(file.bytes.get(), contents.data(), contents.size());
+    file.index_lines();
+
+    return file;
+}
+
+/*
+* Find every line in the buffer. The data is never touched: the BOM
+* and the line breaks are just left out of the views.
+*/
+void
+lrc_file::index_lines ()
+{
+    std::string_view data = strip_lrc_bom(std::string_view(this->bytes.get(), this->length));
+
+    while (!data.empty()) {
+        const void *found = std::memchr(data.data(), '\n', data.size());
+        std::size_t end = found ? static_cast<const char *>(found) - data.data() : data.size();
+
+        split_lrc_line(data.substr(0, end), this->views);
+        data.remove_prefix(found ? end + 1 : end);
+    }
+}
+
+std::span<const std::string_view>
+lrc_file::lines () const
+{
+    return this->views;
+}
+
+/**
+* @brief Copy the lines out, for callers that need to own them.
+*/
+filelines
+lrc_file::to_filelines () const
+{
+    return filelines(this->views.begin(), this->views.end());
+}
+
+/**
+* @brief Where the lines of an .lrc document start, past its BOM.
+*
+* Only the very start of a document may have a BOM, so this is meant
+* for the start of the data, not for every line.
+*
+* @throw std::runtime_error if the data looks like UTF-16/32
+*/
+std::string_view
+strip_lrc_bom (std::string_view data)
+{
+    if (looks_like_utf16_or_utf32(data)) {
+        throw std::runtime_error(
+            "File appears to be UTF-16/32 – LRC must be UTF-8.");
+    }
+
+    if (data.starts_with("\xEF\xBB\xBF")) data.remove_prefix(3);
+
+    return data;
+}
+
+/**
+* @brief Append the lines of a line cut at \n, as views into it.
+*
+* A \r right before the \n is left out, and old Mac files, which
+* break lines with a lone \r, get split there. Whoever reads .lrc
+* lines, from a whole file or line by line, splits them with this, so
+* every reader sees the very same lines.
+*
+* @param line what's between two \n, or the start or end of the data
+* @param lines where the lines are appended, at least one
+*/
+void
+split_lrc_line (std::string_view line, std::vector<std::string_view> &lines)
+{
+    if (line.ends_with('\r')) line.remove_suffix(1);
+
+    // Rare enough to only look for it once \n has been dealt with
+    for (std::size_t cr = line.find('\r'); cr != std::string_view::npos; cr = line.find('\r')) {
+        lines.push_back(line.substr(0, cr));
+        line.remove_prefix(cr + 1);
+    }
+
+    lines.push_back(line);
+}
+
+bool
+looks_like_utf16_or_utf32 (std::string_view s)
+{
+    return
+        (s.size() >= 2 && (s[0] == '\xFE' && s[1] == '\xFF')) ||
+        (s.size() >= 2 && (s[0] == '\xFF' && s[1] == '\xFE')) ||
+        (s.size() >= 4 && (s[0] == '\x00' && s[1] == '\x00' &&
+                           s[2] == '\xFE' && s[3] == '\xFF')) ||
+        (s.size() >= 4 && (s[0] == '\xFF' && s[1] == '\xFE' &&
+                           s[2] == '\x00' && s[3] == '\x00'));
+}
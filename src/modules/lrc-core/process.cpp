@@ -5,48 +5,43 @@
 * Here we'll take a plugins-like approach where the developer can
 * stack multiple functions a.k.a. processing passes for each line.
 * This way, one can run posprocessing passes besides the simple
-* offset correction if it's ever needed (like dropping metadata)
+* offset correction if it's ever needed (like dropping metadata),
+* see stage.hpp.
 *
 * Contains some file I/O management code.
 *
 */
 
 #include <algorithm>
+#include <charconv>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <memory>
+#include <istream>
+#include <ostream>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "diagnostics.hpp"
+#include "idtag.hpp"
 #include "line.hpp"
+#include "lrcfile.hpp"
 #include "process.hpp"
+#include "stage.hpp"
 #include "tag.hpp"
 #include "timestamp.hpp"
 #include "token.hpp"
 
-static
-std::string maybe_chomp_bom(std::string line)
-{
-    if (line.starts_with("\xEF\xBB\xBF"))   // C++20
-        line.erase(0, 3);
-    return line;
-}
-
-bool looks_like_utf16_or_utf32(std::string_view s)
-{
-    return
-        (s.size() >= 2 && (s[0] == '\xFE' && s[1] == '\xFF')) ||
-        (s.size() >= 2 && (s[0] == '\xFF' && s[1] == '\xFE')) ||
-        (s.size() >= 4 && (s[0] == '\x00' && s[1] == '\x00' &&
-                           s[2] == '\xFE' && s[3] == '\xFF')) ||
-        (s.size() >= 4 && (s[0] == '\xFF' && s[1] == '\xFE' &&
-                           s[2] == '\x00' && s[3] == '\x00'));
-}
-
 /**
-* @brief Perform required processing steps to lyrics metadata.
+* @brief Parse a processing options string once, for a lyric_pipeline.
 *
-* This function takes a vector of strings which corresponds to
-* a sequences of lines in the .lrc file format for lyrics.
+* Options are space-separated tokens like "option1 option2:value".
 *
 * Available options:
 *   - correctoffset: Find and the [offset: ms] tag and apply the
@@ -69,144 +64,693 @@ bool looks_like_utf16_or_utf32(std::string_view s)
 *   - dropmetadata: Drop off all the metadata tags on the output
 *     stream. This is useful for directly embedding lyrics onto
 *     a song file metadata.
+*   - drop: Drop these ID tags too, given as comma-separated keys
+*     like "drop:ti,ar,tool".
+*   - headeronly: Only look for tags in the header block, the
+*     lines before the first timestamped one. Past it, every line
+*     is taken as a lyric line, so a mid-file [offset:] is left
+*     as-is instead of changing the running offset. Without this
+*     option, lyric lines are still checked for tags, but only
+*     the ones that could hold any are actually read.
+*   - threads: How many threads run() may split big documents
+*     across, like "threads:4", or "threads:0" for one per core.
+*     Output is the same as with a single thread.
+*   - verbatim: Keep every byte of a line but the ones that change:
+*     timestamps are patched in place and dropped tags clipped
+*     out, instead of rebuilding the line from its tokens, so
+*     spacing like "[00:09.59]I think" is kept as-is.
+*   - expand: Split lines with several timestamps, like
+*     "[00:12.00][01:45.30]chorus", into one line per timestamp,
+*     and put them in time order.
+*   - sort: Put timed lines in time order, see sort_stage.
+*   - dedup: Drop timed lines that repeat one already kept.
+*   - timescale: Stretch every timestamp by this factor, like
+*     "timescale:1.0427" for a track sped up from 23.976 to 25 fps.
+*   - collapse: The other way around from expand: merge timed
+*     lines with the same text into one with all of their
+*     timestamps.
+*
+* @throw std::invalid_argument for an unknown option, a correctoffset,
+* threads or timescale value that isn't a number or an unknown ID tag
+* in drop
+*/
+process_options
+parse_process_options (std::string_view options)
+{
+    process_options parsed;
+
+    // Traverse through the tokenized options
+    for (std::string_view o : tokenize_line(options)) {
+        // option pair key, value, trimmed just in case
+        size_t colon = o.find(':');
+        std::string_view name = trim_view(o.substr(0, colon));
+        std::string_view value = colon == std::string_view::npos ? std::string_view() : trim_view(o.substr(colon + 1));
+
+        if (name == "correctoffset") {
+            parsed.correct_offset = true;
+
+            // Override only if requested
+            if (!value.empty()) {
+                long offset = 0;
+                auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), offset);
+
+                if (ec != std::errc() || end != value.data() + value.size())
+                    throw std::invalid_argument("correctoffset value \"" + std::string(value) + "\" is not a number of ms");
+
+                parsed.offset_override = offset;
+            }
+        }
+        else if (name == "invertoffset") parsed.invert_offset = true;
+        else if (name == "dropmetadata") parsed.drop |= default_dropped_tags;
+        else if (name == "drop") {
+            std::optional<id_tag_set> tags = parse_id_tag_set(value);
+
+            if (!tags)
+                throw std::invalid_argument("unknown ID tag in \"" + std::string(o) + "\"");
+
+            parsed.drop |= *tags;
+        }
+        else if (name == "headeronly") parsed.header_only = true;
+        else if (name == "verbatim") parsed.verbatim = true;
+        else if (name == "expand") parsed.expand = true;
+        else if (name == "collapse") parsed.collapse = true;
+        else if (name == "sort") parsed.sort = true;
+        else if (name == "dedup") parsed.dedup = true;
+        else if (name == "timescale") {
+            double factor = 0;
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), factor);
+
+            if (value.empty() || ec != std::errc() || end != value.data() + value.size() || !(factor > 0))
+                throw std::invalid_argument("timescale value \"" + std::string(value) + "\" is not a positive factor");
+
+            parsed.time_scale = factor;
+        }
+        else if (name == "threads") {
+            if (value.empty() || !is_numeric_only(value) || value[0] == '-' || value.find('.') != std::string_view::npos)
+                throw std::invalid_argument("threads value \"" + std::string(value) + "\" is not a thread count");
+
+            parsed.threads = unsigned(to_long(value));
+        }
+        else throw std::invalid_argument("unknown processing option \"" + std::string(o) + "\"");
+    }
+
+    return parsed;
+}
+
+/**
+* @brief Set up the stages the options ask for.
+*
+* Every line goes through them in this order: [offset:] is read,
+* tags are dropped, timestamps are corrected and scaled, and empty
+* lines are pruned. Then come the steps over the whole document:
+* expanding, sorting, deduplicating and collapsing.
+*/
+lyric_pipeline::lyric_pipeline (process_options options)
+    : opts(options)
+{
+    // [offset:] tags are always read and taken out
+    this->stages.push_back(std::make_shared<offset_stage>(this->opts.offset_override.has_value()));
+
+    if (this->opts.drop) this->stages.push_back(std::make_shared<drop_stage>(this->opts.drop));
+    if (this->opts.correct_offset) {
+        this->corrector = std::make_shared<correct_offset_stage>(this->opts.invert_offset);
+        this->correct_at = this->stages.size();
+        this->stages.push_back(this->corrector);
+    }
+    if (this->opts.time_scale != 1.0) this->stages.push_back(std::make_shared<time_scale_stage>(this->opts.time_scale));
+
+    this->stages.push_back(std::make_shared<prune_stage>());
+    this->custom_at = this->stages.size() - 1;
+
+    if (this->opts.expand) this->stages.push_back(std::make_shared<expand_stage>());
+    if (this->opts.sort) this->stages.push_back(std::make_shared<sort_stage>());
+    if (this->opts.dedup) this->stages.push_back(std::make_shared<dedup_stage>());
+    if (this->opts.collapse) this->stages.push_back(std::make_shared<collapse_stage>());
+}
+
+lyric_pipeline::lyric_pipeline (std::string_view options)
+    : lyric_pipeline(parse_process_options(options))
+{}
+
+/**
+* @brief Plug in a stage of your own.
+*
+* It runs after the built-in stages that change lines and before
+* empty lines are pruned, after any stage added before it. Its
+* on_document runs after the built-in ones.
+*
+* Custom stages may change the running offset in stage_context, which
+* chunks split across threads can't know about beforehand, so a
+* pipeline with any of them always runs on a single thread.
+*
+* @code
+* lyric_pipeline pipeline("correctoffset");
+* pipeline.add_stage(std::make_shared<my_stage>());
+* @endcode
+*/
+lyric_pipeline &
+lyric_pipeline::add_stage (std::shared_ptr<const lyric_stage> stage)
+{
+    this->stages.insert(this->stages.begin() + this->custom_at, std::move(stage));
+    this->custom_at++;
+    this->custom_stages++;
+
+    return *this;
+}
+
+/**
+* @brief Tell if some stage needs the whole document before writing
+* anything out, see lyric_stage::needs_document.
+*/
+bool
+lyric_pipeline::needs_document () const
+{
+    for (const std::shared_ptr<const lyric_stage> &s : this->stages)
+        if (s->needs_document()) return true;
+
+    return false;
+}
+
+// Let the stages work on the whole output, in order
+void
+lyric_pipeline::finish (filelines &out) const
+{
+    for (const std::shared_ptr<const lyric_stage> &s : this->stages)
+        s->on_document(out);
+}
+
+const process_options &
+lyric_pipeline::options () const
+{
+    return this->opts;
+}
+
+/*
+* Fewer lines than this per thread and the threads cost more than
+* what they save.
+*/
+static constexpr std::size_t min_lines_per_thread = 4096;
+
+/*
+* Run body(k) for k in [0, count), each on its own thread, the first
+* one on the calling thread. The first exception thrown, if any, is
+* rethrown once all of them are done.
+*/
+template <typename Body>
+static void
+parallel_for (std::size_t count, Body body)
+{
+    std::vector<std::exception_ptr> errors(count);
+    std::vector<std::thread> workers;
+    workers.reserve(count);
+
+    auto guarded = [&](std::size_t k) {
+        try { body(k); }
+        catch (...) { errors[k] = std::current_exception(); }
+    };
+
+    for (std::size_t k = 1; k < count; k++) workers.emplace_back(guarded, k);
+    if (count > 0) guarded(0);
+
+    for (std::thread &w : workers) w.join();
+
+    for (std::exception_ptr &e : errors)
+        if (e) std::rethrow_exception(e);
+}
+
+/**
+* @brief Perform required processing steps to lyrics metadata.
+*
+* This function takes a vector of strings which corresponds to
+* a sequences of lines in the .lrc file format for lyrics, and
+* runs the steps the pipeline was built with, see
+* parse_process_options for what each one does.
+*
+* Big documents can be split across threads (see threads in
+* process_options) in two phases: every chunk is first scanned in
+* parallel for the last [offset:] it sets, which tells each chunk
+* the offset it starts with, and then all chunks are processed
+* concurrently. The output, warnings included, is exactly the same
+* as processing the document in one go. Pipelines with custom stages
+* always run in one go, see add_stage.
 *
 * @param lyrics A vector containing lyrics lines, preferably
 * read from a .lrc file, but there's a direct overload to read
 * directly data from an .lrc file.
-* @param options Processing options explained above, expressed
-* in a string with space-separated tokens like "option1 option2"
+* @param diag Sink where warnings are buffered, so the caller can
+* report them once at the end.
+*/
+filelines
+lyric_pipeline::run (const filelines &lyrics, diagnostics &diag) const
+{
+    std::vector<std::string_view> views(lyrics.begin(), lyrics.end());
+
+    return this->run(std::span<const std::string_view>(views), diag);
+}
+
+/**
+* @brief Perform required processing steps to lyrics metadata.
+*
+* @note This is the overload everything ends up in: lines are only
+* looked at, so they can be views over a buffer, see lrc_file.
 */
 filelines
-process_lyrics (const filelines lyrics, const std::string options)
+lyric_pipeline::run (std::span<const std::string_view> lyrics, diagnostics &diag) const
 {
+    // Running offset, the override wins over any [offset:] tag
+    long offset = this->opts.offset_override.value_or(0);
+
+    // Tags are expected on top, before the first lyric line
+    size_t header_end = find_header_end(lyrics);
+
+    size_t threads = this->opts.threads ? this->opts.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, lyrics.size() / min_lines_per_thread);
+
+    // Only [offset:] tags are scanned for the offset each chunk starts
+    // with, a custom stage could change it some other way
+    if (this->custom_stages) threads = 1;
+
+    if (threads <= 1) {
+        filelines out = this->run_range(lyrics, 0, header_end, offset, diag);
+        this->finish(out);
+
+        return out;
+    }
+
+    std::span<const std::string_view> all(lyrics);
+
+    // Chunk k spans lines [bounds[k], bounds[k + 1])
+    std::vector<size_t> bounds(threads + 1);
+    for (size_t k = 0; k <= threads; k++) bounds[k] = lyrics.size() * k / threads;
+
+    auto chunk = [&](size_t k) { return all.subspan(bounds[k], bounds[k + 1] - bounds[k]); };
+
+    // First phase: the offset every chunk leaves behind, if any.
+    // The last chunk leaves it to nobody.
+    std::vector<std::optional<long>> last_offsets(threads);
+
+    if (!this->opts.offset_override)
+        parallel_for(threads - 1, [&](size_t k) {
+            last_offsets[k] = this->last_offset_in(chunk(k), bounds[k], header_end);
+        });
+
+    std::vector<long> first_offsets(threads, offset);
+    for (size_t k = 1; k < threads; k++)
+        first_offsets[k] = last_offsets[k - 1].value_or(first_offsets[k - 1]);
+
+    // Second phase: every chunk on its own, with its own sink
+    std::vector<filelines> outs(threads);
+    std::vector<diagnostics> diags(threads, diagnostics(diag.repeat_limit()));
+
+    parallel_for(threads, [&](size_t k) {
+        outs[k] = this->run_range(chunk(k), bounds[k], header_end, first_offsets[k], diags[k]);
+    });
+
+    // Stitch everything back in document order
+    size_t total = 0;
+    for (const filelines &o : outs) total += o.size();
+
     filelines out;
+    out.reserve(total);
 
-    // Read the options string
-    std::vector<std::string_view> options_tokens = tokenize_line(options);
+    for (size_t k = 0; k < threads; k++) {
+        std::move(outs[k].begin(), outs[k].end(), std::back_inserter(out));
+        diag.merge(diags[k]);
+    }
 
-    // Cherry-pick the actually supported options
+    this->finish(out);
 
-    bool correctoffset = false;
-    bool overrideoffset = false;
-    bool invertoffset = false;
-    bool dropmetadata = false;
+    return out;
+}
 
-    // Placeholder variables
-    long offset = 0;
+/*
+* Lines staged at once by run_range, so their timestamps are
+* corrected together; enough to give the SIMD kernel long runs,
+* few enough for their scratch buffers to stay in cache.
+*/
+static constexpr std::size_t correct_batch_lines = 256;
 
-    // Traverse through the tokenized options
-    for (std::string_view o : options_tokens) {
-        // opair = option pair key, value
-        tag opair = slice_at_character(o, ':');
-        // trim pair, just in case
-        opair.name = trim_string(opair.name);
-        opair.value = trim_string(opair.value);
+/*
+* The sequential processing of consecutive lines, starting with the
+* given running offset. first_line is how many lines of the document
+* come before them, header_end is the document's.
+*
+* When correcting offsets, lines go through in batches: every line
+* of a batch runs the stages before correct_offset_stage, all their
+* timestamps are corrected in one pass (see on_lines), and then
+* every line runs the rest of the stages and is written. Custom
+* stages might move the running offset after the correction, so
+* with any of them lines go through one at a time instead.
+*/
+filelines
+lyric_pipeline::run_range (
+    std::span<const std::string_view> lines,
+    std::size_t first_line,
+    std::size_t header_end,
+    long offset,
+    diagnostics &diag
+) const
+{
+    filelines out;
 
-        if (opair.name == "correctoffset") {
-            correctoffset = true;
+    size_t line_number = first_line;
 
-            // Override only if requested
-            if (! (opair.value == "") && is_numeric_only(opair.value)) {
-                offset = std::stol(opair.value);
-                overrideoffset = true;
-            }
+    std::string processed_line;
 
-            continue;
-        }
+    if (!this->corrector || this->custom_stages) {
+        // Every line through every stage, in a single traversal
+        for (std::string_view i : lines) {
+            line_number++;
 
-        if (opair.name == "invertoffset") invertoffset = true;
+            if (!this->take_line(i, line_number, line_number > header_end, offset, processed_line, diag))
+                continue;
 
-        if (opair.name == "dropmetadata") {
-            dropmetadata = true;
+            out.push_back(std::move(processed_line));
         }
+
+        return out;
     }
 
-    // Apply the intended processing steps for each single line
-    for (const std::string &i : lyrics) {
-        // Fist of all, let's gather information from the lines themselves.
-        std::vector<tag> tags = read_tags_from_line(i);
-
-        // To be able to pop off offset lines
-        bool does_this_line_have_an_offset_tag = false;
-
-        std::string processed_line = i;
-
-        // look for an "offset" tag in the current line
-        // additionaly drop metadata tags
-        for (const auto& [key, value] : tags)
-        {
-            if ((key == "offset") || (key == "of"))
-            {
-                if (!value.empty() && is_numeric_only(value)) {
-                    offset = (!overrideoffset ? std::stol(value) : offset);   // update running offset
-                }
-
-                // pop off this line
-                does_this_line_have_an_offset_tag = true;
-                break; // first offset wins
+    // One scratch per line of a batch, reused batch after batch
+    thread_local std::vector<staged_line::scratch> buffers(correct_batch_lines);
+
+    std::vector<staged_line> batch;
+    std::vector<long> offsets;
+    batch.reserve(correct_batch_lines);
+    offsets.reserve(correct_batch_lines);
+
+    stage_context ctx = {offset, diag};
+
+    for (size_t from = 0; from < lines.size(); from += correct_batch_lines) {
+        batch.clear();
+        offsets.clear();
+
+        for (std::string_view i : lines.subspan(from, std::min(correct_batch_lines, lines.size() - from))) {
+            line_number++;
+
+            bool past_header = line_number > header_end;
+            staged_line &staged = batch.emplace_back(i, line_number, this->scan_tags(i, past_header), buffers[batch.size()]);
+
+            bool kept = true;
+            for (size_t s = 0; kept && s < this->correct_at; s++)
+                kept = this->stages[s]->on_line(staged, ctx);
+
+            if (!kept) {
+                batch.pop_back();
+                continue;
             }
-        }
 
-        // Pop metadata tags if requested
-        // Prefer shortest name
-        if (dropmetadata) {
-            processed_line = pop_tag(processed_line, "ti");
-            processed_line = pop_tag(processed_line, "ar");
-            processed_line = pop_tag(processed_line, "al");
-            processed_line = pop_tag(processed_line, "au");
-            processed_line = pop_tag(processed_line, "le");
-            processed_line = pop_tag(processed_line, "by");
-            processed_line = pop_tag(processed_line, "re");
-            processed_line = pop_tag(processed_line, "ve");
+            offsets.push_back(offset);
         }
 
-        // Don't accidentally take away metadata or lyrics but rather
-        // remove the offset tag
-        if (does_this_line_have_an_offset_tag) processed_line = pop_tag(processed_line, "of");
+        this->corrector->on_lines(batch, offsets, diag);
 
-        // Pop empty lines as well
-        if (trim_string(processed_line) == "") continue;
+        for (staged_line &staged : batch) {
+            bool kept = true;
+            for (size_t s = this->correct_at + 1; kept && s < this->stages.size(); s++)
+                kept = this->stages[s]->on_line(staged, ctx);
 
-        if (correctoffset)
-            processed_line = correct_line_offset(processed_line, offset, invertoffset);
+            if (!kept) continue;
 
-        out.push_back(processed_line);
+            staged.write(processed_line, this->opts.verbatim);
+            out.push_back(std::move(processed_line));
+        }
     }
 
     return out;
 }
 
+/*
+* Cheap first phase of a parallel run: the running offset the lines
+* would leave behind, or nothing if none of them sets it. Lines are
+* looked at exactly like take_line does, but nothing is dropped,
+* copied or reported.
+*/
+std::optional<long>
+lyric_pipeline::last_offset_in (std::span<const std::string_view> lines, std::size_t first_line, std::size_t header_end) const
+{
+    thread_local std::vector<tag_view> tags;
+    std::optional<long> last;
+
+    size_t line_number = first_line;
+
+    for (std::string_view i : lines) {
+        line_number++;
+
+        if (line_number > header_end && (this->opts.header_only || !might_have_tags(i))) continue;
+
+        tags.clear();
+        read_tags_from_line(i, tags);
+
+        const tag_view *t = find_offset_tag(tags);
+        if (t && is_offset_value(t->value)) last = to_long(t->value);
+    }
+
+    return last;
+}
+
 /**
-* @brief Perform required processing steps to lyrics metadata.
-* 
-* @note This is an overload to allow directly reading from an .lrc file
+* @brief Tell, with a cheap scan, if running the pipeline over these
+* lyrics would change anything that matters.
+*
+* They're changed if an offset other than 0 is forced on them, or if
+* any of their tags would be dropped, [offset:] included. Scaling,
+* custom stages and any step over the whole document are taken as
+* changes too. Otherwise run() would at most respace lines, drop
+* blank ones and write rounded timestamps back in full, none of
+* which changes what a player shows, so callers can skip writing
+* the output altogether.
+*
+* Lines are filtered like take_line does, so lyric lines that can't
+* hold a tag are never lexed.
+*/
+bool
+lyric_pipeline::would_change (std::span<const std::string_view> lyrics) const
+{
+    if (this->opts.correct_offset && this->opts.offset_override.value_or(0) != 0) return true;
+
+    // No telling what these do short of running them
+    if (this->needs_document() || this->opts.time_scale != 1.0 || this->custom_stages) return true;
+
+    thread_local std::vector<tag_view> tags;
+
+    size_t header_end = find_header_end(lyrics);
+
+    for (size_t l = 0; l < lyrics.size(); l++) {
+        if (l >= header_end && (this->opts.header_only || !might_have_tags(lyrics[l]))) continue;
+
+        tags.clear();
+        read_tags_from_line(lyrics[l], tags);
+
+        for (const tag_view &t : tags) {
+            id_tag kind = classify_id_tag(t.name);
+
+            // [offset:] is always taken out, whatever its value
+            if (kind == id_tag::offset || (id_tag_bit(kind) & this->opts.drop)) return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+lyric_pipeline::would_change (const filelines &lyrics) const
+{
+    std::vector<std::string_view> views(lyrics.begin(), lyrics.end());
+
+    return this->would_change(std::span<const std::string_view>(views));
+}
+
+/*
+* Past the header, lyric lines that can't hold a tag (or shouldn't be
+* looked at) skip tag handling altogether.
+*/
+bool
+lyric_pipeline::scan_tags (std::string_view line, bool past_header) const
+{
+    return !past_header || (!this->opts.header_only && might_have_tags(line));
+}
+
+/*
+* Run a single line through every stage and write it back. Shared
+* by run and lyric_stream, so both keep the exact same lines.
+*
+* Returns false if a stage dropped the line.
+*/
+bool
+lyric_pipeline::take_line (
+    std::string_view line,
+    std::size_t line_number,
+    bool past_header,
+    long &offset,
+    std::string &out,
+    diagnostics &diag
+) const
+{
+    // Reused line after line, so steady-state staging doesn't allocate
+    thread_local staged_line::scratch buffers;
+
+    staged_line staged(line, line_number, this->scan_tags(line, past_header), buffers);
+    stage_context ctx = {offset, diag};
+
+    for (const std::shared_ptr<const lyric_stage> &s : this->stages)
+        if (!s->on_line(staged, ctx)) return false;
+
+    staged.write(out, this->opts.verbatim);
+    return true;
+}
+
+lyric_stream::lyric_stream (const lyric_pipeline &pipeline, line_sink sink, diagnostics &diag)
+    : pipeline(pipeline),
+      sink(std::move(sink)),
+      diag(diag),
+      offset(pipeline.options().offset_override.value_or(0))
+{
+    if (pipeline.needs_document())
+        throw std::invalid_argument("a stage of this pipeline needs the whole document, use run() instead");
+}
+
+/**
+* @brief Process one more line and hand it to the sink right away.
+*
+* Lines must be pushed in document order. Since offsets only depend
+* on the lines above, every line comes out exactly as run() would
+* write it, without waiting for the rest of the document.
+*
+* @param line the next input line, without its line break
+*/
+void
+lyric_stream::push (std::string_view line)
+{
+    this->line_number++;
+
+    // The first timestamped line ends the header, like find_header_end
+    if (!this->past_header && starts_with_timestamp(line)) this->past_header = true;
+
+    if (!this->pipeline.take_line(line, this->line_number, this->past_header, this->offset, this->processed, this->diag))
+        return;
+
+    this->emitted++;
+    this->sink(this->processed);
+}
+
+/**
+* @brief How many lines were handed to the sink so far.
+*/
+std::size_t
+lyric_stream::lines_emitted () const
+{
+    return this->emitted;
+}
+
+/**
+* @brief Read an .lrc file into lines, ready to be processed.
+*
+* The BOM and any line break are left out.
+*
+* @note Copies every line; lrc_file alone hands out views instead.
+*
+* @throw std::runtime_error if the file looks like UTF-16/32
 */
 filelines
-process_lyrics (const fs::path lyrics, const std::string options)
+read_lrc_file (const fs::path &lyrics)
+{
+    return lrc_file(lyrics).to_filelines();
+}
+
+/**
+* @brief Process lyrics as they're read, writing each line right away.
+*
+* Memory use doesn't grow with the document, and when reading from a
+* pipe, output is flushed whenever the input runs dry, so something
+* like `syrinc -f - | player` gets every line as soon as it's ready
+* instead of when the input is closed.
+*
+* If a stage needs the whole document (see needs_document), the
+* input is read to the end first and nothing is written before.
+*
+* @param in where .lrc lines are read from
+* @param out where processed lines are written, one per line
+* @param diag sink for warnings
+*
+* @return how many lines were written
+*
+* @throw std::runtime_error if the input looks like UTF-16/32
+*/
+std::size_t
+lyric_pipeline::stream (std::istream &in, std::ostream &out, diagnostics &diag) const
 {
-    /* 
-        Read the file line by line and just feed it to the original
-        function
-    */
+    if (this->needs_document()) {
+        filelines document;
+        std::string line;
+        std::vector<std::string_view> split;
+
+        // Lines are cut just like lrc_file cuts them
+        for (bool first = true; std::getline(in, line); first = false) {
+            split.clear();
+            split_lrc_line(first ? strip_lrc_bom(line) : std::string_view(line), split);
+            document.insert(document.end(), split.begin(), split.end());
+        }
+
+        filelines processed = this->run(document, diag);
 
-    std::ifstream lrcfile(lyrics);
+        for (const std::string &l : processed) out << l << '\n';
+        out.flush();
 
-    if (!lrcfile.is_open()) return filelines();
+        return processed.size();
+    }
 
-    filelines feed;
+    lyric_stream lines(*this, [&](std::string_view line) {
+        out.write(line.data(), line.size());
+        out.put('\n');
+    }, diag);
 
     std::string line;
-    while (std::getline(lrcfile, line)) {
-        if (feed.empty() && looks_like_utf16_or_utf32(line)) {
-            throw std::runtime_error(
-                "File appears to be UTF-16/32 – LRC must be UTF-8.");
-        }
-        line = maybe_chomp_bom(std::move(line));
-        line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-        feed.push_back(line);
+    std::vector<std::string_view> split;
+
+    for (bool first = true; std::getline(in, line); first = false) {
+        split.clear();
+        split_lrc_line(first ? strip_lrc_bom(line) : std::string_view(line), split);
+
+        for (std::string_view l : split) lines.push(l);
+
+        // Don't hold back lines while waiting for more input
+        if (in.rdbuf()->in_avail() <= 0) out.flush();
     }
 
-    // Feed and return
-    return
-        process_lyrics(feed, options);
-}
\ No newline at end of file
+    out.flush();
+
+    return lines.lines_emitted();
+}
+
+/**
+* @brief Perform required processing steps to lyrics metadata.
+* 
+* @note This is an overload to allow directly reading from an .lrc file
+*/
+filelines
+lyric_pipeline::run (const fs::path &lyrics, diagnostics &diag) const
+{
+    // Read at once, and processed straight from the file buffer
+    lrc_file file(lyrics);
+
+    return this->run(file.lines(), diag);
+}
+
+/**
+* @brief Perform required processing steps to lyrics metadata.
+*
+* @note One-shot shorthand for lyric_pipeline(options).run(lyrics);
+* build the pipeline once instead when processing many documents.
+*/
+filelines
+process_lyrics (const filelines &lyrics, const std::string &options, diagnostics &diag)
+{
+    return lyric_pipeline(options).run(lyrics, diag);
+}
+
+filelines
+process_lyrics (const fs::path &lyrics, const std::string &options, diagnostics &diag)
+{
+    return lyric_pipeline(options).run(lyrics, diag);
+}
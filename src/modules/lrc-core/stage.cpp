@@ -0,0 +1,696 @@
+/**
+* @file stage.cpp
+* @brief The steps a lyric_pipeline is made of, and the line they
+* all work on.
+*
+* @par staged_line line(source, 1, true, buffers);
+* @par drop_stage(default_dropped_tags).on_line(line, ctx);
+*/
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "diagnostics.hpp"
+#include "idtag.hpp"
+#include "line.hpp"
+#include "stage.hpp"
+#include "tag.hpp"
+#include "timestamp.hpp"
+#include "token.hpp"
+
+/**
+* @param line the line as read, it must outlive the staged_line
+* @param number 1-based source line number, for the warnings
+* @param scan_tags whether tags are looked for at all; if not, tags()
+* is always empty
+* @param buffers where lexemes, tags and clips are kept, cleared here
+*/
+staged_line::staged_line (std::string_view line, std::size_t number, bool scan_tags, scratch &buffers)
+    : line(line),
+      number(number),
+      scan_tags(scan_tags),
+      buffers(buffers)
+{
+    this->buffers.clips.clear();
+}
+
+void
+staged_line::lex ()
+{
+    if (this->lexed) return;
+
+    lexeme_buffer &lexemes = this->buffers.lexemes;
+    line_timings &timings = this->buffers.timings;
+
+    lexemes.clear();
+    lex_line(this->line, lexemes);
+    this->lexed = true;
+
+    // The lexer already parsed every timestamp, just gather them
+    timings.durations.clear();
+    timings.lexemes.clear();
+    timings.words.clear();
+
+    for (std::size_t i = 0; i < lexemes.size(); i++) {
+        if (lexemes[i].kind != lexeme_kind::timestamp) continue;
+
+        timings.durations.push_back(lexemes[i].duration);
+        timings.lexemes.push_back(uint32_t(i));
+        timings.words.push_back(i > 0 && lexemes[i - 1].kind == lexeme_kind::angle_open);
+    }
+}
+
+std::string_view
+staged_line::source () const
+{
+    return this->line;
+}
+
+std::size_t
+staged_line::line_number () const
+{
+    return this->number;
+}
+
+/**
+* @brief The lexemes of the line, lexed on first use.
+*
+* Timestamp lexemes keep the durations they were read with, the ones
+* stages change are in timings.
+*/
+std::span<const lexeme>
+staged_line::lexemes ()
+{
+    this->lex();
+    return this->buffers.lexemes;
+}
+
+/**
+* @brief The timestamps of the line, gathered when it's lexed.
+*
+* Stages may rewrite the durations, see retime.
+*/
+line_timings &
+staged_line::timings ()
+{
+    this->lex();
+    return this->buffers.timings;
+}
+
+/**
+* @brief The tags of the line, read from its lexemes on first use.
+*/
+std::span<const tag_view>
+staged_line::tags ()
+{
+    if (!this->scan_tags) return {};
+
+    if (!this->tags_read) {
+        this->lex();
+        this->buffers.tags.clear();
+        read_tags_from_lexemes(this->line, this->buffers.lexemes, this->buffers.tags);
+        this->tags_read = true;
+    }
+
+    return this->buffers.tags;
+}
+
+/**
+* @brief Clip a tag out of the line, timestamps inside it included.
+*
+* Only closed [...] tags can be clipped, <...> groups are timings.
+*
+* @return false if the tag can't be clipped
+*/
+bool
+staged_line::clip (const tag_view &t)
+{
+    if (t.end <= t.begin || this->line[t.begin] != '[' || this->line[t.end - 1] != ']') return false;
+
+    for (const line_span &c : this->buffers.clips)
+        if (c.begin == t.begin) return true;    // already clipped by another stage
+
+    this->buffers.clips.push_back({t.begin, t.end, true});
+    return true;
+}
+
+/**
+* @brief Tell if a lexeme of the line was clipped along with a tag.
+*/
+bool
+staged_line::is_clipped (const lexeme &l) const
+{
+    std::size_t at = l.view.data() - this->line.data();
+
+    for (const line_span &c : this->buffers.clips)
+        if (at >= c.begin && at < c.end) return true;
+
+    return false;
+}
+
+/**
+* @brief Have the timestamps written back from their durations,
+* once a stage changed them.
+*/
+void
+staged_line::retime ()
+{
+    this->retimed = true;
+}
+
+/**
+* @brief Tell if nothing but spaces would be left of the line.
+*/
+bool
+staged_line::blank ()
+{
+    if (this->buffers.clips.empty()) return trim_view(this->line).empty();
+
+    for (const lexeme &l : this->buffers.lexemes)
+        if (!this->is_clipped(l) && !trim_view(l.view).empty()) return false;
+
+    return true;
+}
+
+/**
+* @brief Write the line back with what every stage did to it.
+*
+* A line no stage changed is copied as-is. Otherwise it's rebuilt
+* from its lexemes, like serialize_tokens does, or in verbatim mode
+* patched in place, keeping every byte but the rewritten ones.
+*
+* @param out the written line, reused as is
+* @param verbatim patch the line rather than rebuilding it
+*/
+void
+staged_line::write (std::string &out, bool verbatim)
+{
+    std::vector<line_span> &clips = this->buffers.clips;
+
+    if (!this->lexed || (!this->retimed && clips.empty())) {
+        out.assign(this->line);
+        return;
+    }
+
+    // Stages clip in their own order
+    std::sort(clips.begin(), clips.end(), [](const line_span &a, const line_span &b) { return a.begin < b.begin; });
+
+    const lexeme_buffer &lexemes = this->buffers.lexemes;
+    const line_timings &timings = this->buffers.timings;
+
+    if (verbatim) {
+        std::vector<line_span> &spans = this->buffers.spans;
+        spans.clear();
+
+        auto clip = clips.begin();
+
+        for (std::size_t t = 0; this->retimed && t < timings.durations.size(); t++) {
+            const lexeme &l = lexemes[timings.lexemes[t]];
+            if (this->is_clipped(l)) continue;
+
+            std::size_t begin = l.view.data() - this->line.data();
+
+            for (; clip != clips.end() && clip->begin < begin; clip++) spans.push_back(*clip);
+            spans.push_back({begin, begin + l.view.size(), false, timings.durations[t]});
+        }
+
+        spans.insert(spans.end(), clip, clips.end());
+
+        // Durations are final already, and any warning was given
+        patch_line(this->line, spans, 0, false, out);
+        return;
+    }
+
+    out.clear();
+    out.reserve(this->line.size() + timestamp::max_chars);
+
+    const lexeme *previous = nullptr;
+    std::size_t next = 0;   // next timing, walked along with the lexemes
+
+    for (std::size_t i = 0; i < lexemes.size(); i++) {
+        const lexeme &l = lexemes[i];
+        bool timed = next < timings.lexemes.size() && timings.lexemes[next] == i;
+
+        if (!clips.empty() && this->is_clipped(l)) {
+            next += timed;
+            continue;
+        }
+
+        if (previous && needs_joint(*previous, l)) out += ' ';
+        previous = &l;
+
+        if (timed && this->retimed)
+            append_timestamp(out, timestamp(timings.durations[next]));
+        else
+            out.append(l.view);
+
+        next += timed;
+    }
+}
+
+/* ---------- built-in stages ---------- */
+
+offset_stage::offset_stage (bool overridden)
+    : overridden(overridden)
+{}
+
+/*
+* Every [offset:] of the line is clipped, but only the first one
+* counts; a forced offset is never changed, though bad values are
+* still reported.
+*/
+bool
+offset_stage::on_line (staged_line &line, stage_context &ctx) const
+{
+    std::span<const tag_view> tags = line.tags();
+
+    const tag_view *t = find_offset_tag(tags);
+    if (!t) return true;
+
+    if (is_offset_value(t->value)) {
+        if (!this->overridden) ctx.offset = to_long(t->value);  // update running offset
+    } else {
+        ctx.diag.report(diag_code::bad_offset_value, line.line_number(), t->begin + 1,
+            std::string(line.source().substr(t->begin, t->end - t->begin)) + " is not a number of ms; keeping offset " + std::to_string(ctx.offset));
+    }
+
+    for (const tag_view &o : tags)
+        if (classify_id_tag(o.name) == id_tag::offset) line.clip(o);
+
+    return true;
+}
+
+drop_stage::drop_stage (id_tag_set drop)
+    : drop(drop)
+{}
+
+bool
+drop_stage::on_line (staged_line &line, stage_context &) const
+{
+    for (const tag_view &t : line.tags())
+        if (id_tag_bit(classify_id_tag(t.name)) & this->drop) line.clip(t);
+
+    return true;
+}
+
+correct_offset_stage::correct_offset_stage (bool invert_direction)
+    : invert(invert_direction)
+{}
+
+// Warn about the rounded timestamps of a line that are still in it
+static void
+warn_rounded_timings (staged_line &line, diagnostics &diag)
+{
+    std::span<const lexeme> lexemes = line.lexemes();
+
+    for (uint32_t i : line.timings().lexemes) {
+        const lexeme &l = lexemes[i];
+
+        if (l.rounded && !line.is_clipped(l))
+            warn_rounded_timestamp(l.view, l.duration, diag, line.line_number(), l.view.data() - line.source().data() + 1);
+    }
+}
+
+/*
+* Line and word timings are corrected together, straight over the
+* column of durations.
+*/
+bool
+correct_offset_stage::on_line (staged_line &line, stage_context &ctx) const
+{
+    warn_rounded_timings(line, ctx.diag);
+    apply_offsets(line.timings().durations, ctx.offset, this->invert);
+
+    // Written back even for a 0 offset, like correct_line_offset
+    line.retime();
+    return true;
+}
+
+/**
+* @brief Correct many lines at once, each by the running offset it
+* was staged with.
+*
+* Same as on_line for every line, but the durations of all of them
+* are gathered into one contiguous column, lines sharing an offset
+* share a range of it, and the whole column is corrected with a
+* single apply_offsets pass, so the SIMD loop gets long runs to work
+* on instead of the few timestamps of a single line.
+*
+* @param lines staged lines, in document order
+* @param offsets running offset of each line
+* @param diag sink for rounded timestamp warnings
+*/
+void
+correct_offset_stage::on_lines (std::span<staged_line> lines, std::span<const long> offsets, diagnostics &diag) const
+{
+    // Reused batch after batch
+    thread_local std::vector<int64_t> column;
+    thread_local std::vector<offset_range> ranges;
+
+    column.clear();
+    ranges.clear();
+
+    for (std::size_t l = 0; l < lines.size(); l++) {
+        warn_rounded_timings(lines[l], diag);
+
+        const std::vector<int64_t> &durations = lines[l].timings().durations;
+        std::size_t first = column.size();
+        column.insert(column.end(), durations.begin(), durations.end());
+
+        if (!ranges.empty() && ranges.back().offset == offsets[l])
+            ranges.back().end = column.size();
+        else
+            ranges.push_back({first, column.size(), offsets[l]});
+    }
+
+    apply_offsets(column, ranges, this->invert);
+
+    std::size_t at = 0;
+
+    for (staged_line &line : lines) {
+        std::vector<int64_t> &durations = line.timings().durations;
+        std::copy_n(column.begin() + at, durations.size(), durations.begin());
+        at += durations.size();
+
+        line.retime();
+    }
+}
+
+time_scale_stage::time_scale_stage (double factor)
+    : factor(factor)
+{}
+
+bool
+time_scale_stage::on_line (staged_line &line, stage_context &) const
+{
+    for (int64_t &d : line.timings().durations)
+        d = std::llround(double(d) * this->factor);
+
+    line.retime();
+    return true;
+}
+
+bool
+prune_stage::on_line (staged_line &line, stage_context &) const
+{
+    return !line.blank();
+}
+
+/**
+* @brief Sort a timeline by time, keeping entries with the same time
+* in the order they came in.
+*
+* An LSD radix sort over the 8 bytes of every time, so the cost is
+* linear in the number of entries. All the byte histograms are taken
+* in a single pass, and the passes over a byte that's the same for
+* every entry, like the high bytes of any realistic time, are
+* skipped altogether.
+*/
+void
+sort_timeline (std::vector<timeline_entry> &entries)
+{
+    const std::size_t n = entries.size();
+    if (n < 2) return;
+
+    // Flipping the sign bit orders the keys like the signed times,
+    // negative timestamps and timeline_start included
+    auto key = [](const timeline_entry &e) { return uint64_t(e.time) ^ (uint64_t(1) << 63); };
+
+    std::array<std::array<std::size_t, 256>, 8> counts = {};
+
+    for (const timeline_entry &e : entries) {
+        uint64_t k = key(e);
+        for (unsigned d = 0; d < 8; d++) counts[d][(k >> (8 * d)) & 0xFF]++;
+    }
+
+    std::vector<timeline_entry> buffer(n);
+    timeline_entry *from = entries.data();
+    timeline_entry *to = buffer.data();
+
+    for (unsigned d = 0; d < 8; d++) {
+        std::array<std::size_t, 256> &count = counts[d];
+
+        // Nothing to do if every entry has the same byte here
+        if (count[(key(*from) >> (8 * d)) & 0xFF] == n) continue;
+
+        std::size_t at = 0;
+        for (std::size_t &c : count) {
+            std::size_t here = c;
+            c = at;
+            at += here;
+        }
+
+        for (std::size_t i = 0; i < n; i++)
+            to[count[(key(from[i]) >> (8 * d)) & 0xFF]++] = from[i];
+
+        std::swap(from, to);
+    }
+
+    if (from != entries.data()) std::copy(from, from + n, entries.data());
+}
+
+/*
+* The [mm:ss.cs] groups a line starts with, spaces between them
+* allowed, as {begin, end} byte offsets, brackets included. Returns
+* where the rest of the line starts, right after the last of them.
+*/
+static std::size_t
+leading_stamps (std::string_view line, std::vector<line_span> &stamps)
+{
+    std::size_t rest = 0;
+    std::size_t at = line.find_first_not_of(" \t");
+
+    while (at != std::string_view::npos && line[at] == '[') {
+        std::size_t close = line.find(']', at);
+        if (close == std::string_view::npos) break;
+
+        ts_result ts = scan_timestamp(line.substr(at + 1, close - at - 1));
+        if (ts.ec == ts_errc::not_a_timestamp) break;
+
+        stamps.push_back({at, close + 1, false, ts.duration});
+        rest = close + 1;
+        at = line.find_first_not_of(" \t", rest);
+    }
+
+    return rest;
+}
+
+/*
+* Move every <mm:ss.cs> word timing of a line by shift ms, clamped at
+* zero, leaving its other timestamps alone. Tells if there was any.
+*/
+static bool
+shift_word_timings (staged_line &line, int64_t shift)
+{
+    line_timings &timings = line.timings();
+    bool shifted = false;
+
+    for (std::size_t t = 0; t < timings.durations.size(); t++) {
+        if (!timings.words[t]) continue;
+
+        timings.durations[t] = std::max<int64_t>(timings.durations[t] + shift, 0);
+        shifted = true;
+    }
+
+    if (shifted) line.retime();
+    return shifted;
+}
+
+/*
+* The timeline of a document, one entry per line, timed by its first
+* timestamp (or every one of them, if expanding). Lines before the
+* first timed one are timed timeline_start so they stay on top, and
+* untimed lines further down travel along with the timed line above
+* them.
+*/
+static void
+build_timeline (const filelines &lines, bool every_stamp, std::vector<timeline_entry> &entries)
+{
+    std::vector<line_span> stamps;
+    int64_t carried = timeline_start;
+
+    entries.clear();
+    entries.reserve(lines.size());
+
+    for (std::size_t l = 0; l < lines.size(); l++) {
+        stamps.clear();
+        leading_stamps(lines[l], stamps);
+
+        if (stamps.empty()) {
+            entries.push_back({carried, uint32_t(l), 0});
+            continue;
+        }
+
+        carried = stamps.front().duration;
+
+        std::size_t count = every_stamp ? stamps.size() : 1;
+        for (std::size_t t = 0; t < count; t++)
+            entries.push_back({stamps[t].duration, uint32_t(l), uint32_t(t)});
+    }
+}
+
+static bool
+is_sorted_timeline (const std::vector<timeline_entry> &entries)
+{
+    return std::is_sorted(entries.begin(), entries.end(),
+        [](const timeline_entry &a, const timeline_entry &b) { return a.time < b.time; });
+}
+
+void
+sort_stage::on_document (filelines &lines) const
+{
+    std::vector<timeline_entry> entries;
+    build_timeline(lines, false, entries);
+
+    if (is_sorted_timeline(entries)) return;
+
+    sort_timeline(entries);
+
+    filelines sorted;
+    sorted.reserve(lines.size());
+    for (const timeline_entry &e : entries) sorted.push_back(std::move(lines[e.line]));
+
+    lines = std::move(sorted);
+}
+
+/*
+* Every timed line is split into one line per timestamp, each with
+* the rest of the line as-is, and the result is sorted like
+* sort_stage does. Word timings are taken to be written for the first
+* timestamp, so each copy gets them moved along with its own.
+*/
+void
+expand_stage::on_document (filelines &lines) const
+{
+    std::vector<timeline_entry> entries;
+    build_timeline(lines, true, entries);
+
+    if (entries.size() == lines.size() && is_sorted_timeline(entries)) return;
+
+    sort_timeline(entries);
+
+    filelines expanded;
+    expanded.reserve(entries.size());
+
+    std::vector<line_span> stamps;
+    staged_line::scratch buffers;
+    std::string words;
+
+    for (const timeline_entry &e : entries) {
+        std::string_view line = lines[e.line];
+
+        stamps.clear();
+        std::size_t rest = leading_stamps(line, stamps);
+
+        if (stamps.empty()) {
+            expanded.emplace_back(line);
+            continue;
+        }
+
+        const line_span &stamp = stamps[e.stamp];
+        std::string_view text = line.substr(rest);
+
+        std::string out;
+        out.reserve(stamp.end - stamp.begin + text.size());
+        out.append(line.substr(stamp.begin, stamp.end - stamp.begin));
+
+        // Only copies timed apart from the first have words to move
+        int64_t shift = stamp.duration - stamps[0].duration;
+        staged_line copy(text, e.line + 1, false, buffers);
+
+        if (shift != 0 && shift_word_timings(copy, shift)) {
+            copy.write(words, true);
+            out.append(words);
+        } else {
+            out.append(text);
+        }
+
+        expanded.push_back(std::move(out));
+    }
+
+    lines = std::move(expanded);
+}
+
+/*
+* Timed lines with the same text, spaces around it aside, are merged
+* into the first of them, which gets the timestamps of every other
+* one appended to its own, in document order.
+*/
+void
+collapse_stage::on_document (filelines &lines) const
+{
+    // Text of every timed line kept, and where it went
+    std::unordered_map<std::string_view, std::size_t> by_text;
+    by_text.reserve(lines.size());
+
+    filelines collapsed;
+    std::vector<std::size_t> stamps_end;    // where new timestamps go in each kept line
+    std::vector<line_span> stamps;
+
+    collapsed.reserve(lines.size());
+    stamps_end.reserve(lines.size());
+
+    for (const std::string &line : lines) {
+        stamps.clear();
+        std::size_t rest = leading_stamps(line, stamps);
+
+        if (stamps.empty()) {
+            collapsed.push_back(line);
+            stamps_end.push_back(0);
+            continue;
+        }
+
+        std::string_view text = trim_view(std::string_view(line).substr(rest));
+        auto [kept, first] = by_text.try_emplace(text, collapsed.size());
+
+        if (first) {
+            collapsed.push_back(line);
+            stamps_end.push_back(rest);
+            continue;
+        }
+
+        std::string &into = collapsed[kept->second];
+
+        for (const line_span &t : stamps) {
+            into.insert(stamps_end[kept->second], line, t.begin, t.end - t.begin);
+            stamps_end[kept->second] += t.end - t.begin;
+        }
+    }
+
+    if (collapsed.size() == lines.size()) return;
+
+    lines = std::move(collapsed);
+}
+
+/*
+* Only lines starting with a timestamp are deduplicated: the same
+* words at the same time are a copy for sure, but untimed lines like
+* a repeated chorus are meant to be there.
+*/
+void
+dedup_stage::on_document (filelines &lines) const
+{
+    std::unordered_set<std::string_view> seen;
+    std::vector<bool> keep(lines.size(), true);
+
+    for (std::size_t l = 0; l < lines.size(); l++)
+        if (starts_with_timestamp(lines[l]) && !seen.insert(lines[l]).second) keep[l] = false;
+
+    std::size_t kept = 0;
+    for (std::size_t l = 0; l < lines.size(); l++) {
+        if (!keep[l]) continue;
+        if (kept != l) lines[kept] = std::move(lines[l]);
+        kept++;
+    }
+
+    lines.resize(kept);
+}
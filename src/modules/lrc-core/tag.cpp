@@ -1,8 +1,70 @@
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "diagnostics.hpp"
 #include "globals.hpp"
+#include "stage.hpp"
 #include "timestamp.hpp"
 #include "tag.hpp"
 #include "token.hpp"
 
+// A [...] or <...> group found among the lexemes of a line
+struct lexeme_group {
+    std::size_t open;           // index of the opening lexeme
+    std::size_t close;          // index of the closing one, lexemes.size() if never closed
+    std::string_view content;   // raw bytes between both
+    std::size_t colon;          // key/value colon within content, npos if none
+};
+
+/*
+* Find the next group starting at lexeme index from. Groups opened
+* by either kind of delimiter are closed by either kind, like
+* read_tags_from_line always did.
+*/
+static bool
+next_group (std::span<const lexeme> lexemes, std::string_view source, std::size_t from, lexeme_group &group)
+{
+    std::size_t i = from;
+
+    while (i < lexemes.size()
+        && lexemes[i].kind != lexeme_kind::bracket_open
+        && lexemes[i].kind != lexeme_kind::angle_open) i++;
+
+    if (i == lexemes.size()) return false;
+
+    group.open = i;
+    group.colon = std::string_view::npos;
+
+    const char *begin = lexemes[i].view.data() + 1;
+    const char *colon = nullptr;
+
+    for (i++; i < lexemes.size(); i++) {
+        const lexeme &l = lexemes[i];
+
+        if (l.kind == lexeme_kind::bracket_close || l.kind == lexeme_kind::angle_close) break;
+        if (!colon && l.colon != std::string_view::npos) colon = l.view.data() + l.colon;
+    }
+
+    const char *end = i < lexemes.size() ? lexemes[i].view.data() : source.data() + source.size();
+
+    group.close = i;
+    group.content = std::string_view(begin, end - begin);
+    if (colon) group.colon = colon - begin;
+
+    return true;
+}
+
+// Is this group a bare [mm:ss.cs] and nothing else?
+static bool
+is_timestamp_group (std::span<const lexeme> lexemes, const lexeme_group &group)
+{
+    return group.close - group.open == 2
+        && lexemes[group.open + 1].kind == lexeme_kind::timestamp
+        && lexemes[group.open + 1].view == group.content;
+}
+
 /**
 * @brief Find and parse tags in a lyric line.
 *
@@ -25,76 +87,142 @@
 *    }
 * ]
 *
+* Tags are first found as views (see the tag_view overload) and only
+* copied into owning strings at the end.
 */
 std::vector<tag>
 read_tags_from_line (const std::string_view source)
 {
-    // Auxiliary output
-    std::vector<token> prolly_tags;
+    // Reused line after line, so steady-state reading doesn't allocate
+    thread_local std::vector<tag_view> views;
+
+    views.clear();
+    read_tags_from_line(source, views);
 
     // Actual output
     std::vector<tag> found_tags;
+    found_tags.reserve(views.size());
 
-    // Currently found tag - this will help us concatenate the full tag
-    std::string building_tag;
-
-    // Are we currently inside a tag?
-    bool currently_in_tag = false;
-
-    // Extract everything from inside [x] and <y> pairs
-    for (auto i : source) {
-        switch (i) {
-            case '[':
-            case '<':
-                if (!currently_in_tag) currently_in_tag = true;
-                break;
-
-            case ']':
-            case '>':
-                if (!building_tag.empty()) prolly_tags.push_back(building_tag);
-                building_tag.clear();
-                
-                if (currently_in_tag) currently_in_tag = false;
-                break;
-            
-            default:
-                if (currently_in_tag) building_tag += i;
-                break;
-        }
-    }
+    for (const tag_view &t : views)
+        found_tags.push_back({std::string(t.name), std::string(t.value)});
 
-    if (!building_tag.empty()) prolly_tags.push_back(building_tag);
+    return found_tags;
+}
+
+/**
+* @brief Find tags in a lyric line without copying a single byte.
+*
+* Same tags as the owning overload, but name and value point back
+* into source, and [begin, end) are the byte offsets of the whole
+* tag, brackets included, so it can be spliced out right away.
+* Timestamps are named "time" like in the owning overload.
+*
+* @code
+* // {name: "ar", value: "Junior H", begin: 10, end: 23}
+* std::vector<tag_view> tags;
+* read_tags_from_line("[ti: Ella][ar:Junior H]", tags);
+* @endcode
+*
+* @param source the lyric line to read tags from, it must outlive the views
+* @param tags where tags are appended, clear it to reuse it
+*/
+void
+read_tags_from_line (std::string_view source, std::vector<tag_view> &tags)
+{
+    // Reused line after line, so steady-state lexing doesn't allocate
+    thread_local lexeme_buffer lexemes;
+
+    lexemes.clear();
+    lex_line(source, lexemes);
+
+    read_tags_from_lexemes(source, lexemes, tags);
+}
+
+/**
+* @brief Same as the tag_view overload of read_tags_from_line, for a
+* line that's already lexed.
+*
+* @param source the line the lexemes were lexed from
+* @param lexemes all of its lexemes, see lex_line
+* @param tags where tags are appended, clear it to reuse it
+*/
+void
+read_tags_from_lexemes (std::string_view source, std::span<const lexeme> lexemes, std::vector<tag_view> &tags)
+{
+    lexeme_group group;
+
+    for (std::size_t i = 0; next_group(lexemes, source, i, group); i = group.close) {
+        if (group.content.empty()) continue;
+
+        tag_view found;
+        found.begin = lexemes[group.open].view.data() - source.data();
+        found.end = group.close < lexemes.size()
+            ? lexemes[group.close].view.data() - source.data() + 1
+            : source.size();
 
-    // Now perform the divisions
-    for (auto i : prolly_tags) {
         // Let timestamps intact
-        if (is_it_a_timestamp(i)) {
-            found_tags.emplace_back(
-                "time",
-                i
-            );
-            continue;
+        if (is_timestamp_group(lexemes, group)) {
+            found.name = "time";
+            found.value = group.content;
+        }
+        // Slice tag at the colon the lexer already found
+        else if (group.colon == std::string_view::npos) {
+            found.name = trim_view(group.content);
+        } else {
+            found.name = trim_view(group.content.substr(0, group.colon));
+            found.value = trim_view(group.content.substr(group.colon + 1));
         }
 
-        // Slice tag at the : character
-        tag slicen_tag = slice_at_character(i, ':');
-        slicen_tag.name = trim_string(slicen_tag.name);
-        slicen_tag.value = trim_string(slicen_tag.value);
+        tags.push_back(found);
+    }
+}
+
+/*
+* Lex source once and clip out every closed [...] group the predicate
+* picks, in a single walk. Bare [mm:ss.cs] groups and brackets that
+* are never closed are never handed to it. Returns source as-is when
+* nothing is clipped.
+*/
+template <typename Pick>
+static std::string
+clip_groups (std::string_view source, Pick pick)
+{
+    // Reused call after call, so steady-state lexing doesn't allocate
+    thread_local lexeme_buffer lexemes;
+    thread_local lexeme_buffer kept;
+
+    lexemes.clear();
+    lex_line(source, lexemes);
+
+    kept.clear();
+
+    std::size_t copied = 0;
+    lexeme_group group;
+
+    for (std::size_t i = 0; next_group(lexemes, source, i, group); i = group.close) {
+        if (lexemes[group.open].kind != lexeme_kind::bracket_open) continue;
+        if (group.close == lexemes.size() || lexemes[group.close].kind != lexeme_kind::bracket_close) continue;
+        if (is_timestamp_group(lexemes, group)) continue;
+
+        if (!pick(group.content.substr(0, group.colon))) continue;
 
-        // If all the previous was true, directly push it to the found tags
-        // cutting from the :        
-        found_tags.push_back(slicen_tag);
+        kept.insert(kept.end(), lexemes.begin() + copied, lexemes.begin() + group.open);
+        copied = group.close + 1;
     }
 
-    return found_tags;
+    if (copied == 0) return std::string(source);
+
+    kept.insert(kept.end(), lexemes.begin() + copied, lexemes.end());
+
+    return serialize_tokens(kept);
 }
 
 /**
 * @brief Pop out an .lrc tag with such key
 *
-* This function looks for the tag with such key, finds its opening
-* and closing square brackets, and clips out the content outside of
-* the bracket-enclosed space.
+* This function looks for every [key:value] tag whose key contains
+* such key, and clips it out of the line. Bare [mm:ss.cs] timestamps
+* are never popped, and neither are brackets that are never closed.
 *
 * @param source the lyric line with the key to remove
 * @param key key tag to remove
@@ -103,151 +231,141 @@ read_tags_from_line (const std::string_view source)
 */
 std::string
 pop_tag (std::string source, std::string key) {
-    std::vector<std::string_view> tokenized_source = tokenize_line(source, true);
+    return clip_groups(source, [&](std::string_view key_part) {
+        // ONLY pop this if the occurence is actually part of the key
+        return key_part.find(key) != std::string_view::npos;
+    });
+}
 
-    unsigned long key_index_in_vector = std::string::npos;
-    unsigned long opening_bracket_index = 0;
-    unsigned long closing_bracket_index = std::string::npos;
+/**
+* @brief Tell, with a cheap raw scan, if a line could hold any ID tag.
+*
+* Plain lyric lines like "[00:12.34] text", whose only bracket groups
+* are timestamps, are told apart without lexing them. Anything
+* unusual is reported as a possible tag, for the lexer to judge.
+*/
+bool
+might_have_tags (std::string_view source)
+{
+    for (std::size_t open = source.find('['); open != std::string_view::npos; open = source.find('[', open + 1)) {
+        std::size_t close = source.find_first_of("[]<>", open + 1);
 
-    bool will_need_to_repeat = false;
+        if (close == std::string_view::npos) return false;     // never closed, never dropped
+        if (source[close] != ']') return true;
 
-    /* DEBUG
-    for (std::string i : tokenized_source) {
-        LOG(i, "a token from pop_tag");
-    }
-    */
-    
-
-    // find in vector
-    // start right at 1 because there's no way to
-    // have a tag already opened by a [ in index
-    // below zero, it's absurd
-    for (long i = 0; i < tokenized_source.size(); i++) {
-        if (tokenized_source[i].find(key) != std::string::npos) {
-
-            /* DEBUG
-            std::string safe = tokenized_source[i];
-            if (safe == "[") safe = "OPEN";
-            if (safe == "]") safe = "CLOSE";
-            LOG("token " + std::to_string(i) + " {" + safe + "} is the actual correct tag marker.");
-            */
-        
-            if (key_index_in_vector == std::string::npos) 
-                // the tag is present here
-                key_index_in_vector = i;
-            else
-                // This means that we've been here before
-                // so there are multiple tags with this key
-                // in this line.
-                will_need_to_repeat = true;
-        }
-        /* DEBUG 
-        else {
-            
-            std::string safe = tokenized_source[i];
-            if (safe == "[") safe = "OPEN";
-            if (safe == "]") safe = "CLOSE";
-            LOG("token " + std::to_string(i) + " {" + safe + "} is not the correct tag marker.");
-        }
-        */
+        std::string_view content = source.substr(open + 1, close - open - 1);
+        if (scan_timestamp(content).ec == ts_errc::not_a_timestamp) return true;
     }
 
-    // If the key was never found, return as-is
-    if (key_index_in_vector == std::string::npos) return source;
+    return false;
+}
 
-    // find left brace
-    for (long i = key_index_in_vector; i >= 0; i--) {
-        if (tokenized_source[i] == "[") {
-            opening_bracket_index = i;
-            break;
-        }
-    }
+/**
+* @brief Drop every ID tag in the set, in a single pass.
+*
+* The line goes through a drop_stage on its own, so tags are picked
+* just like a pipeline picks them: each key is classified with one
+* hash lookup (see idtag.hpp) and tested against the set as a
+* bitmask, and unlike pop_tag, keys must match exactly (spaces around
+* them aside), so dropping "ar" leaves [arranger: ...] alone. The line
+* is lexed once, and if none of its tags is dropped it's returned
+* as-is.
+*
+* @code
+* // returns "[00:01.00] Y una bolsita"
+* drop_tags("[ti: Ella][ar:Junior H] [00:01.00] Y una bolsita",
+*     id_tag_bit(id_tag::title) | id_tag_bit(id_tag::artist));
+* @endcode
+*
+* @param source the lyric line to drop tags from
+* @param tags ID tags to drop
+*
+* @return source line without any of such tags
+*/
+std::string
+drop_tags (std::string_view source, id_tag_set tags)
+{
+    if (tags == 0 || !might_have_tags(source)) return std::string(source);
 
-    // find right brace
-    for (long i = key_index_in_vector; i < tokenized_source.size(); i++) {
-        if (tokenized_source[i] == "]") {
-            closing_bracket_index = i;
-            break;
-        }
-    }
+    // Reused line after line, so steady-state dropping doesn't allocate
+    thread_local staged_line::scratch buffers;
 
-    // If matching brackets were not found
-    if (
-        // if index 0 is not actually a brace
-        opening_bracket_index == 0 && tokenized_source[0] != "["
-    ||  closing_bracket_index == std::string::npos
-    ||  opening_bracket_index >= tokenized_source.size()
-    ||  closing_bracket_index >= tokenized_source.size()
-    ||  opening_bracket_index > closing_bracket_index
-    ) {
-        return source; // as-is
-    }
-    /* DEBUG
-    LOG(std::to_string(key_index_in_vector), "key index in vector");
-    LOG(std::to_string(opening_bracket_index), "opening bracket index");
-    LOG(std::to_string(closing_bracket_index), "closing bracket index");
-    */
-
-    // once the indices are found, we'll clip out
-    // whatever is not part of the tag we want to pop
-
-    // part before the opening bracket
-    std::vector<std::string_view> lpart (
-        tokenized_source.begin(),
-        tokenized_source.begin() + opening_bracket_index);
-
-    std::vector<std::string_view> rpart (
-        tokenized_source.begin() + closing_bracket_index + 1,
-        tokenized_source.end()
-    );
-    // we'll need this to validate what we just did
-    std::vector<std::string_view> thepart (
-        tokenized_source.begin() + opening_bracket_index,
-        tokenized_source.begin() + closing_bracket_index
-    );
-
-    // ONLY pop this if the occurence is actually part of the key
-    std::string thepart_serialized = serialize_tokens(thepart);
-    int thepart_colon_index = thepart_serialized.find(':');
-    if (thepart_colon_index != std::string::npos)
-        if (thepart_serialized.substr(0, thepart_colon_index).find(key) == std::string::npos)
-            return source;
-
-    // concatenate
-    lpart.insert(lpart.end(), rpart.begin(), rpart.end());
-
-    std::string out = serialize_tokens(lpart, " ", true);
-
-    if (will_need_to_repeat) out = pop_tag(out, key);
+    long offset = 0;
+    stage_context ctx = {offset, thread_diagnostics()};
+    staged_line line(source, 0, true, buffers);
+    drop_stage(tags).on_line(line, ctx);
 
+    std::string out;
+    line.write(out, false);
     return out;
 }
 
 /**
-* @brief Divide a string into a pair, cutting from the first joint character.
+* @brief Find the [offset:] tag that counts among the tags of a line.
 *
-* @return A string pair containing the text before the joint character and the text after.
-* For instance:
-*   "offset: 750" -> {"offset", "750"}
-*   "correctoffset" -> {"correctoffset", ""}
+* @return the first one, or nullptr if there's none
+*/
+const tag_view *
+find_offset_tag (std::span<const tag_view> tags)
+{
+    for (const tag_view &t : tags)
+        if (classify_id_tag(t.name) == id_tag::offset) return &t;   // first offset wins
+
+    return nullptr;
+}
+
+/**
+* @brief Tell if an [offset:] value is a number of ms at all.
+*/
+bool
+is_offset_value (std::string_view value)
+{
+    return !value.empty() && is_numeric_only(value);
+}
+
+/**
+* @brief Tell if a line starts with a [mm:ss.cs] timestamp, i.e. if
+* it's a lyric line rather than a header one.
+*/
+bool
+starts_with_timestamp (std::string_view line)
+{
+    line = trim_view(line);
+
+    if (line.empty() || line[0] != '[') return false;
+
+    std::size_t close = line.find(']');
+    if (close == std::string_view::npos) return false;
+
+    return scan_timestamp(line.substr(1, close - 1)).ec != ts_errc::not_a_timestamp;
+}
+
+/**
+* @brief Find where the header block of a document ends.
+*
+* ID tags and [offset:] are expected on top of the file, before the
+* first lyric line, so the header is every line up to the first one
+* that starts with a [mm:ss.cs] timestamp.
 *
+* @param lines the document lines
+*
+* @return how many lines the header spans, so lines[result] is the
+* first lyric line, or lines.size() if there's none
 */
-tag
-slice_at_character (const std::string_view source, char joint)
+std::size_t
+find_header_end (std::span<const std::string> lines)
 {
-    tag slicen;
-    
-    // Find tag marker separation index
-    int joint_index = source.find_first_of(joint);
-
-    // If the joint is not found, let the entire tag be the name
-    if (joint_index == std::string::npos) {
-        slicen.name = source;
-        return slicen;
-    }
+    for (std::size_t l = 0; l < lines.size(); l++)
+        if (starts_with_timestamp(lines[l])) return l;
+
+    return lines.size();
+}
 
-    slicen.name = source.substr(0, joint_index);
-    slicen.value = source.substr(joint_index + 1, source.length());
+std::size_t
+find_header_end (std::span<const std::string_view> lines)
+{
+    for (std::size_t l = 0; l < lines.size(); l++)
+        if (starts_with_timestamp(lines[l])) return l;
 
-    return slicen;
-}
\ No newline at end of file
+    return lines.size();
+}
@@ -6,258 +6,139 @@
 * @par ms_to_timestamp(1404350);
 */
 
-#include <algorithm>
 #include <charconv>
-#include <cctype>
 #include <cstdint>
-#include <iostream>
 #include <string>
 #include <string_view>
 
+#include "charclass.hpp"
+#include "diagnostics.hpp"
 #include "timestamp.hpp"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-/*
-* Allow the same timestamp to be represented in its
-* multiple forms
-*/
-
-// Construct a timestamp from an already-ms length
-timestamp::timestamp(int64_t duration)
-{
-    this->duration = duration;
-}
 
-/**
-* @brief Construct a timestamp from a string by
-* separating the timestamp in mm:ss.cs
-* to mm, ss, ms format.
-*
-* @param source timestamp to be split.
-*
-* @code
-* // returns mm = 0, ss = 0, ms = 100
-* ts_components ts = timestamp("00:00.10").as_tsmap();
-* 
-* // returns mm = 12, ss = 34, ms = 560
-* ts_components ts = divide_timestamp("12:34.56").as_tsmap();
-* @endcode
-*
-* @return the source timestamp as a struct with
-* mm, ss and cs members representing the
-* original source duration.
+/*
+* The pure arithmetic lives in timestamp.hpp as constexpr, here's
+* only what can't run at compile time.
 */
-int64_t
-parse_timestamp (std::string_view source, bool disable_warning)
-{
-    if (!is_it_a_timestamp(source)) {
-        return 0;
-    };
-
-    ts_components ts;
-
-    // if a round-trip is performed, we'll advise the user
-    // at the end
-    bool trigger_warning = false;
-
-    ts.mm = ts.ss = ts.cs = 0;
-
-    int colon_pos = source.find_first_of(':');
-    int dot_pos = source.find_first_of('.');
-
-    /* is_it_a_timestamp requires : and . to be
-    present to pass, so no need to verify it
-    again
-    */
-
-    bool is_negative = source[0] == '-';
-
-    std::string_view minutes_component = source.substr((is_negative ? 1 : 0), colon_pos);
-    std::string_view seconds_component = source.substr(colon_pos + 1, source.length() - dot_pos - 1);
-    std::string_view centiseconds_component = source.substr(dot_pos + 1, source.length() - dot_pos - 1);
-
-    // the check of the components being all numeric
-    // was already done by is_it_a_timestamp, so
-    // no need of a try-catch here
-    ts.is_negative = is_negative;
-    ts.mm = to_long(minutes_component);
-    ts.ss = to_long(seconds_component);
-    ts.cs = to_long(centiseconds_component);
-
-    // Everybody could make mistakes with formatting
-    // so I'll be forgiving by performing a round-trip
-    // that will automatically balance the lengths
-
-    if (
-        ts.ss >= 60
-    ||  ts.cs >= 100
-    ) {
-        ts = timestamp(
-            (ts.mm * 60000)
-            + (ts.ss * 1000)
-            + (ts.cs * 10)
-        ).as_tsmap();
-
-        trigger_warning = true;
-    }
-
-    int64_t duration = ((ts.mm * 60000)
-                    + (ts.ss * 1000)
-                    + (ts.cs * 10))
-                    * (is_negative ? -1 : 1);
-
-    // Trigger a warning if a roundtrip had to be performed
-    if (trigger_warning && !disable_warning)
-            // obviously will show a warning
-            std::cerr << "warning: " << source << " timestamp is malformed; will round up to " + timestamp(duration).as_string() + "..." << std::endl;
-
-    return duration;
-}
 
 timestamp::timestamp (std::string source, bool disable_warning)
-{
-    this->duration = parse_timestamp(source, disable_warning);
-}
+    : timestamp(std::string_view(source), disable_warning)
+{}
 
-timestamp::timestamp (std::string_view source, bool disable_warning)
+std::string
+timestamp::as_string (bool no_filling) const
 {
-    this->duration = parse_timestamp(source, disable_warning);
-}
+    char buffer[max_chars];
+    char *end = this->write_to(buffer, no_filling ? format_no_filling : format_default);
 
-/**
-* @brief Return timestamp as a milliseconds length.
-*/
-int64_t
-timestamp::as_ms() const
-{
-    return this->duration;
+    return std::string(buffer, end);
 }
 
 /**
-* @brief Return the timestamp as a timestamp map form.
-*
-* @code
-* // returns mm = 0, ss = 0, ms = 100
-* ts_components ts = divide_timestamp("00:00.10");
-* 
-* // returns mm = 12, ss = 34, ms = 560
-* ts_components ts = divide_timestamp("12:34.56");
-* @endcode
+* @brief Let the user know a timestamp had to be rounded up.
 *
-* @param zero_negative_timestamp clamp all negative timestamps
-* to zero
+* The warning is buffered in the diagnostics sink rather than
+* written right away.
 *
-* @return the source timestamp as a struct with
-* mm, ss and cs members representing the timestamp
+* @param line 1-based line of the timestamp, 0 if unknown
+* @param column 1-based column of the timestamp, 0 if unknown
 */
-ts_components
-timestamp::as_tsmap (bool zero_negative_timestamps) const
-{
-    ts_components ts;
-    ts.mm = ts.ss = ts.cs = 0;
-    long remaining_ms = this->duration;
-    bool is_source_negative = false;
-    if (remaining_ms < 0) {
-        // Round negative timestamps up to zero if needed
-        if (!zero_negative_timestamps) {
-            remaining_ms *= -1;
-            is_source_negative = true;
-        } else
-            // just return a zeroed timestamp, no need to
-            // manually convert
-            return ts;
-    }
-
-    // Progressive reduction, bigger units first
-
-    ts.mm = remaining_ms / 60000; remaining_ms -= ts.mm * 60000;
-    ts.ss = remaining_ms / 1000; remaining_ms -= ts.ss * 1000;
-    ts.cs = remaining_ms / 10;
-
-    return ts;
-}
-
-std::string
-timestamp::as_string (bool no_filling) const
+void
+warn_rounded_timestamp (std::string_view source, int64_t duration, diagnostics &diag, std::size_t line, std::size_t column)
 {
-    ts_components ts = this->as_tsmap();
-
-    return // with filling if needed
-        std::string((this->duration < 0) ? "-" : "")
-    +   (ts.mm < 10 && !no_filling ? "0" : "") + std::to_string(ts.mm) + ":"
-    +   (ts.ss < 10 && !no_filling ? "0" : "") + std::to_string(ts.ss) + "."
-    +   (ts.cs < 10 && !no_filling ? "0" : "") + std::to_string(ts.cs);
+    diag.report(
+        diag_code::rounded_timestamp,
+        line,
+        column,
+        std::string(source) + " timestamp is malformed; will round up to " + timestamp(duration).as_string() + "..."
+    );
 }
 
 /**
-* @brief Apply an offset, expressed in milliseconds, to a timestamp.
+* @brief Apply the same offset to a whole column of durations at once.
 *
-* By default, a negative integer delays the timestamp and vice versa
-* according to most implementations in the wild, as if a negative
-* value meant "this is X milliseconds behind where it's supposed
-* to be".
-* 
-* You can invert this behavior by setting invert_direction to true,
-* so it fits with the analogy of a positive number meaning "this
-* is intended to be shown X milliseconds later".
-* @code
-* // returns "00:13.00"
-* std::string ts = apply_offset_to_timestamp("00:12.33", -670");
-* @endcode
+* Same math as timestamp::apply_offset, subtract and clamp at zero,
+* but over contiguous ms durations so it compiles to one tight loop:
+* 4 durations per step with AVX2, 2 with SSE2, or scalar otherwise.
 *
-* @param source the timestamp to be corrected
+* @param durations timestamps, in ms, corrected in place
 * @param offset offset value, expressed in milliseconds
 * @param invert_direction negate the sign of the offset
 */
-timestamp &
-timestamp::apply_offset (const long offset, bool invert_direction)
-{    
-    this->duration -= (offset * (invert_direction ? -1 : 1));
+void
+apply_offsets (std::span<int64_t> durations, long offset, bool invert_direction)
+{
+    const int64_t shift = int64_t(offset) * (invert_direction ? -1 : 1);
 
-    // prevent from going below zero
-    if (this->duration <= 0) this->duration = 0;
+    int64_t *data = durations.data();
+    std::size_t count = durations.size();
+    std::size_t i = 0;
 
-    return *this;
-}
+#if defined(__AVX2__)
+    const __m256i delta = _mm256_set1_epi64x(shift);
+    const __m256i zero = _mm256_setzero_si256();
 
+    for (; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        v = _mm256_sub_epi64(v, delta);
 
-/**
-* @brief Check if a given string is an mm:ss.ms timestamp
-*
-* Ensure that all the chacarters of the string are actually a timestamp representation.
-* The only requirements are that all of the characters are digits, : or .
-*/
-bool
-is_it_a_timestamp (const std::string_view source)
-{
-    if (source.empty()) return false;
+        // prevent from going below zero
+        v = _mm256_andnot_si256(_mm256_cmpgt_epi64(zero, v), v);
 
-    bool is_negative = source[0] == '-';
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), v);
+    }
+#elif defined(__SSE2__)
+    const __m128i delta = _mm_set1_epi64x(shift);
 
-    // count colons and dots
-    int colon_count = std::count(source.begin(), source.end(), ':');
-    int dot_count = std::count(source.begin(), source.end(), '.');
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        v = _mm_sub_epi64(v, delta);
 
+        // SSE2 has no 64-bit compare; spread the sign of each high
+        // dword over its whole lane to zero out the negatives
+        __m128i negative = _mm_shuffle_epi32(_mm_srai_epi32(v, 31), _MM_SHUFFLE(3, 3, 1, 1));
+        v = _mm_andnot_si128(negative, v);
 
-    // It is a malformed timestamp if it doesn't contain
-    // exactly 1 : and 1 .
-    if (colon_count != 1 || dot_count != 1)
-        return false;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), v);
+    }
+#endif
 
-    // allowing the first char to be a minus sign
-    for (int i = (is_negative ? 1 : 0); i < source.length(); i++) {
-        if (
-            ! (
-                std::isdigit(source[i])
-            ||  source[i] == ':'
-            ||  source[i] == '.'
-            )
-        ) {
-            return false;
-        }
+    // leftovers, or everything without SIMD
+    for (; i < count; i++) {
+        int64_t v = data[i] - shift;
+        data[i] = v <= 0 ? 0 : v;
     }
+}
 
-    return true;
+/**
+* @brief Apply a running offset to a whole document's timestamps in one pass.
+*
+* Every range corrects its own run of durations, as if each one came
+* after its own [offset:] tag. Durations not covered by any range are
+* left untouched.
+*
+* @param durations timestamps of the document, in ms and in order
+* @param ranges runs of durations sharing an offset
+* @param invert_direction negate the sign of every offset
+*/
+void
+apply_offsets (std::span<int64_t> durations, std::span<const offset_range> ranges, bool invert_direction)
+{
+    for (const offset_range &range : ranges) {
+        if (range.begin >= range.end || range.end > durations.size()) continue;
+
+        apply_offsets(
+            durations.subspan(range.begin, range.end - range.begin),
+            range.offset,
+            invert_direction
+        );
+    }
 }
 
 /**
@@ -268,7 +149,7 @@ is_numeric_only (const std::string_view source)
 {
     // for "" it returns true as it can be treated as 0
     for (int i = 0; i < source.length(); i++) {
-        if (!std::isdigit(source[i]) && source[i] != '.') {
+        if (!is_char(source[i], cc_digit) && source[i] != '.') {
             // Allow the first char to be a minus sign
             if (i == 0 && source[i] == '-') {
                 continue;
@@ -4,16 +4,71 @@
 * serialize afterwards.
 * @par tokenize_lyric_line ("[00:00:00] Beginning of a song");
 * @par serialize_lyric_tokens ({"[", "00:12.34", "Another", "part"});
+* @par lex_line ("[00:12.34] Another part", lexemes);
+* @par trim_view ("  [ti: Ella]  ");
 * 
 */
 
 #include <algorithm>
-#include <cctype>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
 #include <string>
 #include <vector>
 
+#include "charclass.hpp"
+#include "timestamp.hpp"
 #include "token.hpp"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+static constexpr size_t simd_block_size = 32;
+
+/*
+* Bit i is set if block[i] is a space or, for lyric lines,
+* one of [ ] < >
+*/
+static inline uint32_t
+delimiter_mask (const char *block, bool treat_as_lyrics_line)
+{
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+    __m256i hits = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' '));
+
+    if (treat_as_lyrics_line) {
+        for (char c : {'[', ']', '<', '>'})
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)));
+    }
+
+    return uint32_t(_mm256_movemask_epi8(hits));
+}
+#elif defined(__SSE2__)
+static constexpr size_t simd_block_size = 16;
+
+/*
+* Bit i is set if block[i] is a space or, for lyric lines,
+* one of [ ] < >
+*/
+static inline uint32_t
+delimiter_mask (const char *block, bool treat_as_lyrics_line)
+{
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+    __m128i hits = _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '));
+
+    if (treat_as_lyrics_line) {
+        for (char c : {'[', ']', '<', '>'})
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+    }
+
+    return uint32_t(_mm_movemask_epi8(hits));
+}
+#endif
+
 /**
 * @brief Split a line in multiple "tokens" in order to be able to
 * do the timestamp correction
@@ -30,42 +85,304 @@ std::vector<std::string_view>
 tokenize_line(std::string_view source, bool treat_as_lyrics_line)
 {
     std::vector<std::string_view> tokens;
+    tokenize_line(source, tokens, treat_as_lyrics_line);
+    return tokens;
+}
+
+/**
+* @brief Split a line in multiple "tokens" into a caller-owned buffer.
+*
+* Tokens are appended to whatever the buffer already holds, so a
+* whole document can be tokenized into one buffer, or a buffer can be
+* cleared and reused line after line: once it has grown enough, no
+* more heap allocations happen for tokenization.
+*
+* With SSE2 or AVX2 around, 16 or 32 bytes are classified per step
+* and only the delimiters found are visited.
+*
+* @code
+* token_buffer tokens;
+* for (const std::string &line : lyrics) {
+*     tokens.clear();
+*     tokenize_line(line, tokens, true);
+* }
+* @endcode
+*/
+void
+tokenize_line(std::string_view source, token_buffer &tokens, bool treat_as_lyrics_line)
+{
+    const char *data = source.data();
+    const size_t size = source.size();
+
+    // Delimiters end the current token; tag delimiters are tokens themselves
+    const uint8_t delimiters = cc_token_break | (treat_as_lyrics_line ? cc_tag_delimiter : 0);
 
     size_t token_start = 0;
-    bool in_token = false;
 
-    auto flush = [&](size_t end) {
-        if (in_token && end > token_start)
-            tokens.emplace_back(source.data() + token_start, end - token_start);
-        in_token = false;
+    auto split_at = [&](size_t delimiter) {
+        if (delimiter > token_start)
+            tokens.emplace_back(data + token_start, delimiter - token_start);
+
+        if (!is_char(data[delimiter], cc_token_break))
+            tokens.emplace_back(data + delimiter, 1);
+
+        token_start = delimiter + 1;
     };
 
-    for (size_t i = 0; i < source.size(); ++i) {
-        char c = source[i];
+    size_t i = 0;
 
-        if (c == ' ') {
-            flush(i);
-            continue;
-        }
+#if defined(__SSE2__)
+    // Classify a whole block per step, then only visit the delimiters
+    for (; i + simd_block_size <= size; i += simd_block_size) {
+        uint32_t mask = delimiter_mask(data + i, treat_as_lyrics_line);
 
-        if (treat_as_lyrics_line &&
-            (c == '[' || c == ']' || c == '<' || c == '>'))
-        {
-            flush(i);
-            tokens.emplace_back(source.data() + i, 1); // ← CORRECTO
-            continue;
+        while (mask != 0) {
+            split_at(i + std::countr_zero(mask));
+            mask &= mask - 1;
         }
+    }
+#endif
+
+    // leftovers, or everything without SIMD
+    for (; i < size; i++)
+        if (is_char(data[i], delimiters)) split_at(i);
+
+    if (size > token_start)
+        tokens.emplace_back(data + token_start, size - token_start);
+}
 
-        if (!in_token) {
-            token_start = i;
-            in_token = true;
+/**
+* @brief Split a lyric line into typed lexemes, once.
+*
+* Tokens are cut exactly like tokenize_line does for lyric lines, and
+* each one is told apart right away: tag delimiters, lone colons,
+* timestamps (already parsed), the key and value parts of tags and
+* plain lyric text. Whoever consumes the lexemes doesn't need to look
+* at the bytes again to know what they are.
+*
+* @code
+* // [00:12.34] Hello [ar:Junior H]
+* // bracket_open, timestamp (12340), bracket_close, text,
+* // bracket_open, tag_key (colon = 2), tag_value, bracket_close
+* lexeme_buffer lexemes;
+* lex_line("[00:12.34] Hello [ar:Junior H]", lexemes);
+* @endcode
+*
+* @param source the lyric line to lex
+* @param lexemes where lexemes are appended, clear it to reuse it
+*/
+void
+lex_line (std::string_view source, lexeme_buffer &lexemes)
+{
+    thread_local token_buffer tokens;
+
+    tokens.clear();
+    tokenize_line(source, tokens, true);
+
+    bool in_tag = false;
+    bool seen_colon = false;
+
+    for (std::string_view token : tokens) {
+        lexeme l = {lexeme_kind::text, token};
+
+        switch (classify_token(token)) {
+            case token_kind::tag_open:
+                l.kind = token[0] == '[' ? lexeme_kind::bracket_open : lexeme_kind::angle_open;
+                in_tag = true;
+                seen_colon = false;
+                break;
+
+            case token_kind::tag_close:
+                l.kind = token[0] == ']' ? lexeme_kind::bracket_close : lexeme_kind::angle_close;
+                in_tag = false;
+                break;
+
+            case token_kind::colon:
+                l.kind = lexeme_kind::colon;
+                if (in_tag && !seen_colon) {
+                    l.colon = 0;
+                    seen_colon = true;
+                }
+                break;
+
+            case token_kind::text: {
+                ts_result ts = scan_timestamp(token);
+
+                if (ts.ec != ts_errc::not_a_timestamp) {
+                    l.kind = lexeme_kind::timestamp;
+                    l.duration = ts.duration;
+                    l.rounded = ts.ec == ts_errc::rounded;
+
+                    // [offset 00:01.00] is still split at its first colon
+                    if (in_tag && !seen_colon) {
+                        l.colon = token.find(':');
+                        seen_colon = true;
+                    }
+                    break;
+                }
+
+                if (!in_tag) break;
+
+                if (seen_colon) {
+                    l.kind = lexeme_kind::tag_value;
+                    break;
+                }
+
+                l.kind = lexeme_kind::tag_key;
+                l.colon = token.find(':');
+                seen_colon = l.colon != std::string_view::npos;
+                break;
+            }
         }
+
+        lexemes.push_back(l);
     }
+}
 
-    flush(source.size());
-    return tokens;
+// Kind of every single-char token, indexed by the char itself
+static constexpr std::array<token_kind, 256> single_char_kinds = []{
+    std::array<token_kind, 256> table = {};
+
+    table['['] = table['<'] = token_kind::tag_open;
+    table[']'] = table['>'] = token_kind::tag_close;
+    table[':'] = token_kind::colon;
+
+    return table;
+}();
+
+/**
+* @brief Tell what a token is, as far as joints are concerned.
+*
+* Only single-char tokens can be tag delimiters or colons, so
+* anything longer is text without even looking at it.
+*/
+token_kind
+classify_token (std::string_view token)
+{
+    return token.size() == 1
+        ? single_char_kinds[static_cast<unsigned char>(token[0])]
+        : token_kind::text;
+}
+
+/*
+* Lyric lines need their own special treatment. So, if the previous
+* token was an opening tag character or the current is a closing one
+* or a colon, the joint is not written at this exact position.
+*
+* Indexed as [previous][current].
+*/
+static constexpr bool lyrics_joint_table[4][4] = {
+    //              text   open   close  colon
+    /* text  */   { true,  true,  false, false },
+    /* open  */   { false, false, false, false },
+    /* close */   { true,  true,  false, false },
+    /* colon */   { true,  true,  false, false },
+};
+
+static bool
+joint_between (token_kind previous, token_kind current, bool treat_as_lyrics_line)
+{
+    return !treat_as_lyrics_line
+        || lyrics_joint_table[std::size_t(previous)][std::size_t(current)];
 }
 
+/**
+* @brief Tell if the joint has to be written between two adjacent tokens.
+*
+* This keeps timestamps tight together like [00:00.00].
+*/
+bool
+needs_joint (std::string_view previous, std::string_view current, bool treat_as_lyrics_line)
+{
+    return joint_between(classify_token(previous), classify_token(current), treat_as_lyrics_line);
+}
+
+/**
+* @brief Tell what a lexeme is, as far as joints are concerned.
+*/
+token_kind
+joint_kind_of (lexeme_kind kind)
+{
+    switch (kind) {
+        case lexeme_kind::bracket_open:
+        case lexeme_kind::angle_open:
+            return token_kind::tag_open;
+        case lexeme_kind::bracket_close:
+        case lexeme_kind::angle_close:
+            return token_kind::tag_close;
+        case lexeme_kind::colon:
+            return token_kind::colon;
+        default:
+            return token_kind::text;
+    }
+}
+
+/**
+* @brief Tell if the joint has to be written between two adjacent lexemes.
+*
+* Same rule as for tokens, but straight from the lexeme kinds.
+*/
+bool
+needs_joint (const lexeme &previous, const lexeme &current)
+{
+    return joint_between(joint_kind_of(previous.kind), joint_kind_of(current.kind), true);
+}
+
+/*
+* How the serializer sees each kind of token it may be handed
+*/
+static std::string_view view_of (std::string_view token) { return token; }
+static std::string_view view_of (const std::string &token) { return token; }
+static std::string_view view_of (const lexeme &l) { return l.view; }
+
+static token_kind joint_kind_of (std::string_view token) { return classify_token(token); }
+static token_kind joint_kind_of (const std::string &token) { return classify_token(token); }
+static token_kind joint_kind_of (const lexeme &l) { return joint_kind_of(l.kind); }
+
+/*
+* Shared by every serialize_tokens overload, so a vector of strings
+* is serialized as-is instead of being turned into views first.
+*/
+template <typename Tokens>
+static std::string
+serialize (const Tokens &token_vector, std::string_view joint, bool treat_as_lyrics_line)
+{
+    if (token_vector.empty()) return std::string();
+
+    // First pass: the exact output length, so there's only one allocation
+    size_t length = view_of(token_vector[0]).size();
+    token_kind previous = joint_kind_of(token_vector[0]);
+
+    for (size_t i = 1; i < token_vector.size(); i++) {
+        token_kind current = joint_kind_of(token_vector[i]);
+
+        if (joint_between(previous, current, treat_as_lyrics_line)) length += joint.size();
+        length += view_of(token_vector[i]).size();
+
+        previous = current;
+    }
+
+    std::string out(length, '\0');
+    char *cursor = out.data();
+
+    // Second pass: the actual joint, copied straight into place
+    std::string_view first = view_of(token_vector[0]);
+    cursor = std::copy(first.begin(), first.end(), cursor);
+    previous = joint_kind_of(token_vector[0]);
+
+    for (size_t i = 1; i < token_vector.size(); i++) {
+        token_kind current = joint_kind_of(token_vector[i]);
+        std::string_view token = view_of(token_vector[i]);
+
+        if (joint_between(previous, current, treat_as_lyrics_line))
+            cursor = std::copy(joint.begin(), joint.end(), cursor);
+        cursor = std::copy(token.begin(), token.end(), cursor);
+
+        previous = current;
+    }
+
+    return out;
+}
 
 /**
 * @brief Convert a token list to a single string
@@ -78,40 +395,9 @@ tokenize_line(std::string_view source, bool treat_as_lyrics_line)
 *
 */
 std::string
-serialize_tokens (const std::vector<std::string_view> token_vector, std::string_view joint, bool treat_as_lyrics_line)
+serialize_tokens (const std::vector<std::string_view> &token_vector, std::string_view joint, bool treat_as_lyrics_line)
 {
-    std::string out;
-    // To keep timestamps tight together
-    bool dont_write_joint = false;
-
-    for (int i = 0; i < token_vector.size(); i++) {
-        // First item safeguard
-        if (i <= 0) {
-            out += token_vector[i]; 
-            continue;
-        }
-
-        // Lyric lines need their own special treatment. So,
-        // If the previous was an opening tag character
-        // or the current is a closing one...
-        // don't write a space AT THIS EXACT POSITION
-        if (
-            (
-                token_vector[i - 1] == "[" || token_vector[i] == "]"
-            ||  token_vector[i - 1] == "<" || token_vector[i] == ">"
-            ||  token_vector[i]     == ":"
-            ) && treat_as_lyrics_line
-        )
-            dont_write_joint = true;
-        else
-            dont_write_joint = false;
-
-        // Perform the actual joint
-        if (!dont_write_joint) out.append(joint);
-        out.append(token_vector[i]);
-    }
-
-    return out;
+    return serialize(token_vector, joint, treat_as_lyrics_line);
 }
 
 std::string
@@ -121,30 +407,47 @@ serialize_tokens (
     bool treat_as_lyrics_line
 )
 {
-    std::vector<std::string_view> token_views;
-    token_views.reserve(token_vector.size());
-
-    for (const std::string& token : token_vector) {
-        token_views.emplace_back(token);
-    }
+    return serialize(token_vector, joint, treat_as_lyrics_line);
+}
 
-    return serialize_tokens(token_views, joint, treat_as_lyrics_line);
+/**
+* @brief Convert lexemes back to a single lyric line.
+*
+* Joints are decided from the lexeme kinds alone, so the bytes of
+* each lexeme are only touched to copy them.
+*/
+std::string
+serialize_tokens (std::span<const lexeme> lexemes, std::string_view joint)
+{
+    return serialize(lexemes, joint, true);
 }
 
 
 /**
 * @brief Remove leading and trailing whitespace characters.
+*
+* Nothing is copied: the result is a view into source, empty if
+* source is made of whitespace only.
+*/
+std::string_view
+trim_view (std::string_view source)
+{
+    std::size_t begin = 0;
+    std::size_t end = source.size();
+
+    while (begin < end && is_char(source[begin], cc_space)) begin++;
+    while (end > begin && is_char(source[end - 1], cc_space)) end--;
+
+    return source.substr(begin, end - begin);
+}
+
+/**
+* @brief Remove leading and trailing whitespace characters.
+*
+* @note Owning counterpart of trim_view, for callers that need a string.
 */
 std::string
-trim_string(std::string s)
-{
-    // left trim
-    s.erase(s.begin(),
-            std::find_if_not(s.begin(), s.end(),
-                             [](unsigned char c){ return std::isspace(c); }));
-    // right trim
-    s.erase(std::find_if_not(s.rbegin(), s.rend(),
-                             [](unsigned char c){ return std::isspace(c); }).base(),
-            s.end());
-    return s;
-}
\ No newline at end of file
+trim_string (std::string_view source)
+{
+    return std::string(trim_view(source));
+}
@@ -0,0 +1,495 @@
+// bench-lrc-core.cpp
+// g++ -std=c++20 -O2 bench-lrc-core.cpp src/modules/lrc-core/*.cpp -I src/include -I src/include/modules/lrc-core && ./a.out
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "line.hpp"
+#include "process.hpp"
+#include "stage.hpp"
+#include "tag.hpp"
+#include "timestamp.hpp"
+#include "token.hpp"
+
+using namespace std;
+
+/* ---------- helpers ---------- */
+
+// Keep the optimizer from throwing the measured work away
+static volatile int64_t sink;
+
+template <typename F>
+void BENCH(const string& title, size_t ops, F&& body)
+{
+    // warm up caches and branch predictors first
+    body();
+
+    auto start = chrono::steady_clock::now();
+    body();
+    auto end = chrono::steady_clock::now();
+
+    double ns = chrono::duration<double, nano>(end - start).count();
+    cout << title << ": " << ns / ops << " ns/op\n";
+}
+
+/* A token mix resembling a real lyric line: mostly words, a few timestamps */
+static vector<string> lyric_tokens()
+{
+    vector<string> base = {
+        "00:09.59", "I", "think", "of", "you", "all", "of", "the", "time",
+        "00:23.67", "I've", "been", "doin'", "all", "kinds", "of", "drugs",
+        "01:00.20", "And", "disappear", "for", "a", "while", "-00:00.14",
+        "123:456.789", "04:32.227", "12:34:56", "offset"
+    };
+
+    vector<string> out;
+    for (int i = 0; i < 4096; i++)
+        out.insert(out.end(), base.begin(), base.end());
+    return out;
+}
+
+/* ---------- legacy validator + parser pair, kept for reference ---------- */
+
+static bool legacy_is_it_a_timestamp(string_view source)
+{
+    if (source.empty()) return false;
+
+    bool is_negative = source[0] == '-';
+
+    int colon_count = count(source.begin(), source.end(), ':');
+    int dot_count = count(source.begin(), source.end(), '.');
+
+    if (colon_count != 1 || dot_count != 1)
+        return false;
+
+    for (size_t i = (is_negative ? 1 : 0); i < source.length(); i++)
+        if (!(isdigit(source[i]) || source[i] == ':' || source[i] == '.'))
+            return false;
+
+    return true;
+}
+
+static long legacy_to_long(string_view sv)
+{
+    long value = 0;
+    auto [ptr, ec] = from_chars(sv.data(), sv.data() + sv.size(), value);
+    return ec != errc() ? 0 : value;
+}
+
+static int64_t legacy_parse_timestamp(string_view source)
+{
+    if (!legacy_is_it_a_timestamp(source)) return 0;
+
+    size_t colon_pos = source.find_first_of(':');
+    size_t dot_pos = source.find_first_of('.');
+    bool is_negative = source[0] == '-';
+
+    int64_t mm = legacy_to_long(source.substr((is_negative ? 1 : 0), colon_pos));
+    int64_t ss = legacy_to_long(source.substr(colon_pos + 1, source.length() - dot_pos - 1));
+    int64_t cs = legacy_to_long(source.substr(dot_pos + 1, source.length() - dot_pos - 1));
+
+    return (mm * 60000 + ss * 1000 + cs * 10) * (is_negative ? -1 : 1);
+}
+
+/* ---------- timestamp classification + parsing ---------- */
+void BENCH_timestamp_parsing()
+{
+    cout << "\n===== timestamp validate + parse =====\n";
+    const vector<string> tokens = lyric_tokens();
+
+    BENCH("legacy is_it_a_timestamp + parse_timestamp", tokens.size(), [&]{
+        int64_t acc = 0;
+        for (const string& t : tokens)
+            if (legacy_is_it_a_timestamp(t)) acc += legacy_parse_timestamp(t);
+        sink = acc;
+    });
+
+    BENCH("fused scan_timestamp_generic", tokens.size(), [&]{
+        int64_t acc = 0;
+        for (const string& t : tokens) {
+            ts_result r = scan_timestamp_generic(t);
+            if (r.ec != ts_errc::not_a_timestamp) acc += r.duration;
+        }
+        sink = acc;
+    });
+
+    BENCH("fused scan_timestamp (canonical fast path)", tokens.size(), [&]{
+        int64_t acc = 0;
+        for (const string& t : tokens) {
+            ts_result r = scan_timestamp(t);
+            if (r.ec != ts_errc::not_a_timestamp) acc += r.duration;
+        }
+        sink = acc;
+    });
+}
+
+/* ---------- canonical mm:ss.cs timestamps only ---------- */
+void BENCH_canonical_timestamps()
+{
+    cout << "\n===== canonical timestamps =====\n";
+    vector<string> tokens;
+    for (int i = 0; i < 100000; i++)
+        tokens.push_back(timestamp(int64_t(i) * 7310 % 6000000).as_string());
+
+    BENCH("scan_timestamp_generic", tokens.size(), [&]{
+        int64_t acc = 0;
+        for (const string& t : tokens) acc += scan_timestamp_generic(t).duration;
+        sink = acc;
+    });
+
+    BENCH("scan_canonical_timestamp (SWAR)", tokens.size(), [&]{
+        int64_t acc = 0;
+        for (const string& t : tokens) acc += scan_canonical_timestamp(t).duration;
+        sink = acc;
+    });
+}
+
+/* ---------- whole-document offset correction ---------- */
+void BENCH_apply_offsets()
+{
+    cout << "\n===== offset correction =====\n";
+    vector<int64_t> column;
+    for (int64_t i = 0; i < 1000000; i++) column.push_back(i * 37 % 6000000);
+
+    BENCH("timestamp::apply_offset per object", column.size(), [&]{
+        vector<int64_t> out = column;
+        for (int64_t& d : out) d = timestamp(d).apply_offset(750).as_ms();
+        sink = out.back();
+    });
+
+    BENCH("apply_offsets batch kernel", column.size(), [&]{
+        vector<int64_t> out = column;
+        apply_offsets(out, 750);
+        sink = out.back();
+    });
+}
+
+/* ---------- token classification on lyric lines ---------- */
+void BENCH_token_classifier()
+{
+    cout << "\n===== token classifier (per lyric line) =====\n";
+
+    const vector<string> base = {
+        "[00:09.59]I think of you all of the time",
+        "[00:17.07]Now that you're gone",
+        "[00:23.67]I've been doin' all kinds of drugs",
+        "[00:30.83]To get you out of my mind",
+        "[00:38.82]'Cause I noticed you don't like me no more",
+        "[00:46.09]And it breaks my heart",
+        "[00:53.61]So I'll just drift away",
+        "[01:00.20]And disappear for a while"
+    };
+
+    vector<string> lines;
+    for (int i = 0; i < 4096; i++) lines.insert(lines.end(), base.begin(), base.end());
+
+    vector<vector<string_view>> tokenized;
+    for (const string& l : lines) tokenized.push_back(tokenize_line(l, true));
+
+    BENCH("legacy is_it_a_timestamp", lines.size(), [&]{
+        int64_t acc = 0;
+        for (const auto& tokens : tokenized)
+            for (string_view t : tokens) acc += legacy_is_it_a_timestamp(t);
+        sink = acc;
+    });
+
+    BENCH("is_it_a_timestamp (char class table)", lines.size(), [&]{
+        int64_t acc = 0;
+        for (const auto& tokens : tokenized)
+            for (string_view t : tokens) acc += is_it_a_timestamp(t);
+        sink = acc;
+    });
+
+    BENCH("whole correct_line_offset, for reference", lines.size(), [&]{
+        size_t acc = 0;
+        for (const string& l : lines) acc += correct_line_offset(l, 750).size();
+        sink = acc;
+    });
+}
+
+/* ---------- legacy byte-at-a-time tokenizer, kept for reference ---------- */
+static void legacy_tokenize_line(string_view source, vector<string_view>& tokens, bool lyrics)
+{
+    size_t token_start = 0;
+    bool in_token = false;
+
+    auto flush = [&](size_t end) {
+        if (in_token && end > token_start)
+            tokens.emplace_back(source.data() + token_start, end - token_start);
+        in_token = false;
+    };
+
+    for (size_t i = 0; i < source.size(); ++i) {
+        char c = source[i];
+        if (c == ' ') { flush(i); continue; }
+        if (lyrics && (c == '[' || c == ']' || c == '<' || c == '>')) {
+            flush(i);
+            tokens.emplace_back(source.data() + i, 1);
+            continue;
+        }
+        if (!in_token) { token_start = i; in_token = true; }
+    }
+
+    flush(source.size());
+}
+
+/* ---------- tokenizing long karaoke lines ---------- */
+void BENCH_tokenize_line()
+{
+    cout << "\n===== tokenize_line (karaoke lines with word tags) =====\n";
+
+    const vector<string> base = {
+        "[00:09.59]<00:09.59>I <00:09.90>think <00:10.31>of <00:10.52>you <00:10.98>all <00:11.40>of <00:11.62>the <00:11.90>time",
+        "[00:23.67]<00:23.67>I've <00:24.01>been <00:24.30>doin' <00:24.88>all <00:25.20>kinds <00:25.71>of <00:26.02>drugs",
+        "[00:38.82]'Cause I noticed you don't like me no more, and it breaks my heart so I'll just drift away"
+    };
+
+    vector<string> lines;
+    size_t bytes = 0;
+    for (int i = 0; i < 8192; i++)
+        for (const string& l : base) { lines.push_back(l); bytes += l.size(); }
+
+    vector<string_view> tokens;
+
+    BENCH("legacy byte-at-a-time tokenizer (per line)", lines.size(), [&]{
+        size_t acc = 0;
+        for (const string& l : lines) { tokens.clear(); legacy_tokenize_line(l, tokens, true); acc += tokens.size(); }
+        sink = acc;
+    });
+
+    BENCH("tokenize_line with delimiter bitmasks (per line)", lines.size(), [&]{
+        size_t acc = 0;
+        for (const string& l : lines) { tokens.clear(); tokenize_line(l, tokens, true); acc += tokens.size(); }
+        sink = acc;
+    });
+
+    cout << "average line length: " << bytes / lines.size() << " bytes\n";
+}
+
+/* ---------- legacy serializer, kept for reference ---------- */
+static string legacy_serialize_tokens(const vector<string_view> v, string_view joint, bool lyrics)
+{
+    string out;
+    for (size_t i = 0; i < v.size(); i++) {
+        if (i == 0) { out += v[i]; continue; }
+        bool tight = (v[i - 1] == "[" || v[i] == "]" || v[i - 1] == "<" || v[i] == ">" || v[i] == ":") && lyrics;
+        if (!tight) out.append(joint);
+        out.append(v[i]);
+    }
+    return out;
+}
+
+static string legacy_serialize_tokens(const vector<string>& v, string_view joint, bool lyrics)
+{
+    vector<string_view> views(v.begin(), v.end());
+    return legacy_serialize_tokens(views, joint, lyrics);
+}
+
+/* ---------- serializing lines and whole documents ---------- */
+void BENCH_serialize_tokens()
+{
+    cout << "\n===== serialize_tokens =====\n";
+
+    const string line = "[00:09.59]<00:09.59>I <00:09.90>think <00:10.31>of <00:10.52>you <00:10.98>all <00:11.40>of <00:11.62>the <00:11.90>time";
+    const vector<string_view> tokens = tokenize_line(line, true);
+    const size_t rounds = 100000;
+
+    BENCH("legacy serialize_tokens (per line)", rounds, [&]{
+        size_t acc = 0;
+        for (size_t i = 0; i < rounds; i++) acc += legacy_serialize_tokens(tokens, " ", true).size();
+        sink = acc;
+    });
+
+    BENCH("serialize_tokens (per line)", rounds, [&]{
+        size_t acc = 0;
+        for (size_t i = 0; i < rounds; i++) acc += serialize_tokens(tokens, " ", true).size();
+        sink = acc;
+    });
+
+    const vector<string> document(20000, line);
+
+    BENCH("legacy serialize_tokens (20k-line document)", 1, [&]{
+        sink = legacy_serialize_tokens(document, "\n", false).size();
+    });
+
+    BENCH("serialize_tokens (20k-line document)", 1, [&]{
+        sink = serialize_tokens(document, "\n", false).size();
+    });
+}
+
+/* ---------- dropping metadata tags ---------- */
+void BENCH_drop_metadata()
+{
+    cout << "\n===== dropping metadata (per line) =====\n";
+
+    const vector<string> base = {
+        "[ti: Ella][ar:Junior H][al:$AD BOYZ 4 LIFE II]",
+        "[by: someone][re: some editor][ve: 1.0]",
+        "[00:09.59]I think of you all of the time",
+        "[00:17.07]Now that you're gone",
+        "[00:23.67]I've been doin' all kinds of drugs"
+    };
+
+    vector<string> lines;
+    for (int i = 0; i < 8192; i++) lines.insert(lines.end(), base.begin(), base.end());
+
+    static constexpr string_view keys[] = {"ti", "ar", "al", "au", "le", "by", "re", "ve"};
+    static constexpr id_tag_set tags = *parse_id_tag_set("ti,ar,al,au,le,by,re,ve");
+
+    BENCH("plain copy, for reference", lines.size(), [&]{
+        size_t acc = 0;
+        for (const string& l : lines) acc += string(l).size();
+        sink = acc;
+    });
+
+    BENCH("pop_tag once per key", lines.size(), [&]{
+        size_t acc = 0;
+        for (const string& l : lines) {
+            string out = l;
+            for (string_view k : keys) out = pop_tag(out, string(k));
+            acc += out.size();
+        }
+        sink = acc;
+    });
+
+    BENCH("drop_tags with an ID tag bitmask", lines.size(), [&]{
+        size_t acc = 0;
+        for (const string& l : lines) acc += drop_tags(l, tags).size();
+        sink = acc;
+    });
+}
+
+/* ---------- whole documents through process_lyrics ---------- */
+void BENCH_process_lyrics()
+{
+    cout << "\n===== process_lyrics (per line, header + 40k lyric lines) =====\n";
+
+    filelines document = {"[ti: Ella]", "[ar:Junior H]", "[al:$AD BOYZ 4 LIFE II]", "[offset: 750]", ""};
+    for (int i = 0; i < 40000; i++)
+        document.push_back("[" + timestamp(int64_t(i) * 2500).as_string() + "]I think of you all of the time");
+
+    BENCH("dropmetadata, every line checked for tags", document.size(), [&]{
+        sink = process_lyrics(document, "dropmetadata").size();
+    });
+
+    BENCH("dropmetadata headeronly", document.size(), [&]{
+        sink = process_lyrics(document, "dropmetadata headeronly").size();
+    });
+
+    BENCH("correctoffset dropmetadata, lines rebuilt", document.size(), [&]{
+        sink = process_lyrics(document, "correctoffset dropmetadata").size();
+    });
+
+    BENCH("correctoffset dropmetadata verbatim, lines patched", document.size(), [&]{
+        sink = process_lyrics(document, "correctoffset dropmetadata verbatim").size();
+    });
+}
+
+/* ---------- word-synced karaoke ---------- */
+void BENCH_word_timings()
+{
+    cout << "\n===== enhanced LRC (per line, 40k lines, 8 word timings each) =====\n";
+
+    filelines document = {"[ti: Ella]", "[offset: 750]", ""};
+    for (int i = 0; i < 40000; i++) {
+        int64_t at = int64_t(i) * 2500;
+        string line = "[" + timestamp(at).as_string() + "]";
+        for (int w = 0; w < 8; w++)
+            line += "<" + timestamp(at + w * 300).as_string() + ">word" + to_string(w) + " ";
+        document.push_back(line);
+    }
+
+    for (const char* opts : {"correctoffset dropmetadata", "correctoffset dropmetadata verbatim"}) {
+        const lyric_pipeline pipeline(opts);
+        BENCH(opts, document.size(), [&]{
+            sink = pipeline.run(document).size();
+        });
+    }
+}
+
+/* ---------- huge documents split across threads ---------- */
+void BENCH_parallel_run()
+{
+    cout << "\n===== lyric_pipeline::run (per line, 1M-line document) =====\n";
+
+    filelines document = {"[ti: Ella]", "[offset: 750]", ""};
+    for (int i = 0; i < 1000000; i++) {
+        if (i % 50000 == 0) document.push_back("[offset: " + to_string(i % 3000) + "]");
+        document.push_back("[" + timestamp(int64_t(i) * 250).as_string() + "]I think of you all of the time");
+    }
+
+    for (const char* opts : {"correctoffset dropmetadata threads:1", "correctoffset dropmetadata threads:0"}) {
+        const lyric_pipeline pipeline(opts);
+        BENCH(opts, document.size(), [&]{
+            sink = pipeline.run(document).size();
+        });
+    }
+
+    cout << "hardware threads: " << thread::hardware_concurrency() << '\n';
+}
+
+/* ---------- timelines of whole catalogues ---------- */
+void BENCH_timeline()
+{
+    cout << "\n===== timeline sort (per entry, 1M entries) =====\n";
+
+    // Times as a catalogue of songs would have them, up to ~10 minutes
+    vector<timeline_entry> entries;
+    uint64_t seed = 88172645463325252ull;
+    for (uint32_t i = 0; i < 1000000; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        entries.push_back({int64_t(seed % 600000), i, 0});
+    }
+
+    vector<timeline_entry> work;
+
+    BENCH("std::stable_sort", entries.size(), [&]{
+        work = entries;
+        stable_sort(work.begin(), work.end(), [](const timeline_entry& a, const timeline_entry& b){ return a.time < b.time; });
+        sink = work.front().line;
+    });
+
+    BENCH("sort_timeline (LSD radix)", entries.size(), [&]{
+        work = entries;
+        sort_timeline(work);
+        sink = work.front().line;
+    });
+
+    cout << "\n===== expand (per input line, 200k lines, 3 timestamps each) =====\n";
+
+    filelines document;
+    for (int i = 0; i < 200000; i++)
+        document.push_back("[" + timestamp(int64_t(i) * 900).as_string() + "][" + timestamp(int64_t(i) * 700).as_string()
+            + "][" + timestamp(int64_t(i) * 1100).as_string() + "]I think of you all of the time");
+
+    const expand_stage expand;
+    BENCH("expand_stage", document.size(), [&]{
+        filelines lines = document;
+        expand.on_document(lines);
+        sink = lines.size();
+    });
+}
+
+/* ---------- main driver ---------- */
+int main()
+{
+    BENCH_timestamp_parsing();
+    BENCH_canonical_timestamps();
+    BENCH_apply_offsets();
+    BENCH_token_classifier();
+    BENCH_tokenize_line();
+    BENCH_serialize_tokens();
+    BENCH_drop_metadata();
+    BENCH_process_lyrics();
+    BENCH_word_timings();
+    BENCH_parallel_run();
+    BENCH_timeline();
+    return 0;
+}
@@ -1,14 +1,23 @@
 // unit_tests.cpp
 // g++ -std=c++17 unit_tests.cpp src/*.cpp -I src/include && ./a.out
+#include <algorithm>
+#include <array>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
 #include <vector>
 #include <string>
 
+#include "diagnostics.hpp"
+#include "idtag.hpp"
 #include "process.hpp"
+#include "stage.hpp"
 #include "tag.hpp"
 #include "timestamp.hpp"
 #include "token.hpp"
 #include "line.hpp"
+#include "lrcfile.hpp"
 
 // #include "src/include/debug.hpp"
 
@@ -21,6 +30,90 @@ void PRINT(const std::string& title, const T& in, const U& out)
     std::cout << title << "  in: \"" << in << "\"  out: \"" << out << "\"\n";
 }
 
+/* ---------- compile-time checks ---------- */
+using namespace timestamp_literals;
+
+constexpr bool formats_as(int64_t ms, std::string_view expected,
+                          timestamp::format_flags flags = timestamp::format_default)
+{
+    char buffer[timestamp::max_chars] = {};
+    char *end = timestamp(ms).write_to(buffer, flags);
+    return std::string_view(buffer, end - buffer) == expected;
+}
+
+// is_it_a_timestamp
+static_assert(is_it_a_timestamp("00:00.00"));
+static_assert(is_it_a_timestamp("12:34.56"));
+static_assert(is_it_a_timestamp("9:59.99"));
+static_assert(is_it_a_timestamp("-12:34.56"));
+static_assert(!is_it_a_timestamp("12-34.56"));
+static_assert(!is_it_a_timestamp("12:34:56"));
+static_assert(!is_it_a_timestamp("abc"));
+static_assert(!is_it_a_timestamp(""));
+static_assert(!is_it_a_timestamp("00:00a00"));
+static_assert(!is_it_a_timestamp("56.65:23"));
+static_assert(!is_it_a_timestamp("250"));
+
+// timestamp_to_ms
+static_assert(parse_timestamp("00:00.01") == 10);
+static_assert(parse_timestamp("12:34.56") == 754560);
+static_assert(parse_timestamp("99:59.99") == 5999990);
+static_assert(parse_timestamp("-65:55.36") == -3955360);
+static_assert(parse_timestamp("123:456.789") == 7843890);
+static_assert(parse_timestamp("invalid") == 0);
+static_assert(("01:23.45"_ts).as_ms() == 83450);
+
+// classify_id_tag
+static_assert(classify_id_tag("ti") == id_tag::title);
+static_assert(classify_id_tag("of") == id_tag::offset);
+static_assert(classify_id_tag("offset") == id_tag::offset);
+static_assert(classify_id_tag("le") == classify_id_tag("length"));
+static_assert(classify_id_tag("#") == id_tag::comment);
+static_assert(classify_id_tag("tool") == id_tag::tool);
+static_assert(classify_id_tag("arranger") == id_tag::unknown);
+static_assert(classify_id_tag("") == id_tag::unknown);
+static_assert(classify_id_tag("TI") == id_tag::unknown);
+static_assert([]{
+    for (const id_tag_key& k : id_tag_keys)
+        if (classify_id_tag(k.key) != k.tag) return false;
+    return true;
+}());
+
+// parse_id_tag_set
+static_assert(parse_id_tag_set("ti, ar,tool") ==
+              (id_tag_bit(id_tag::title) | id_tag_bit(id_tag::artist) | id_tag_bit(id_tag::tool)));
+static_assert(parse_id_tag_set("") == id_tag_set(0));
+static_assert(!parse_id_tag_set("ti,nope"));
+
+// divide_timestamp
+static_assert(("12:34.56"_ts).as_tsmap().mm == 12);
+static_assert(("12:34.56"_ts).as_tsmap().ss == 34);
+static_assert(("12:34.56"_ts).as_tsmap().cs == 56);
+static_assert(timestamp(-565).as_tsmap().is_negative);
+static_assert(timestamp(ts_components{false, 12, 34, 56}).as_ms() == 754560);
+
+// ms_to_timestamp
+static_assert(formats_as(0, "00:00.00"));
+static_assert(formats_as(65536, "01:05.53"));
+static_assert(formats_as(65536, "1:5.53", timestamp::format_no_filling));
+static_assert(formats_as(-65536, "-01:05.53"));
+static_assert(formats_as(3659990, "60:59.99"));
+static_assert(formats_as(7843890, "130:43.89"));
+
+// apply_offset_to_timestamp
+static_assert(("00:02.00"_ts).apply_offset(1250).as_ms() == 750);
+static_assert(("00:00.00"_ts).apply_offset(1250).as_ms() == 0);
+static_assert(("12:34.56"_ts).apply_offset(1250, true).as_ms() == 755810);
+
+// a table of known timestamps, shifted entirely at compile time
+constexpr std::array<timestamp, 3> shifted_chorus = []{
+    std::array<timestamp, 3> table = {"00:12.00"_ts, "01:45.30"_ts, "02:58.49"_ts};
+    for (timestamp &t : table) t.apply_offset(-750);
+    return table;
+}();
+static_assert(shifted_chorus[0].as_ms() == 12750);
+static_assert(shifted_chorus[2].as_ms() == 179240);
+
 /* ---------- divide_timestamp ---------- */
 void TEST_divide_timestamp()
 {
@@ -57,6 +150,17 @@ void TEST_ms_to_timestamp()
     run(-89);
     run(-65536);
     run(65536);
+
+    /* caller buffers, unpadded and overlong minutes */
+    auto run_buffer = [](long ms, timestamp::format_flags flags){
+        char buffer[timestamp::max_chars];
+        char *end = timestamp(ms).write_to(buffer, flags);
+        PRINT("write_to", ms, string(buffer, end));
+    };
+    run_buffer(65536, timestamp::format_default);
+    run_buffer(65536, timestamp::format_no_filling);
+    run_buffer(-89, timestamp::format_no_filling);
+    run_buffer(7843890, timestamp::format_default);
 }
 
 /* ---------- timestamp_to_ms ---------- */
@@ -159,6 +263,66 @@ void TEST_is_it_a_timestamp()
     run("1000");
 }
 
+/* ---------- canonical timestamp fast path vs parse_timestamp ---------- */
+void TEST_canonical_timestamp_differential()
+{
+    cout << "\n===== scan_canonical_timestamp vs parse_timestamp =====\n";
+
+    auto two_digits = [](int v){
+        return string(1, char('0' + v / 10)) + char('0' + v % 10);
+    };
+
+    long checked = 0;
+    long failed = 0;
+
+    // every canonical value from 00:00.00 to 99:59.99
+    for (int mm = 0; mm < 100; mm++)
+    for (int ss = 0; ss < 60; ss++)
+    for (int cs = 0; cs < 100; cs++) {
+        string ts = two_digits(mm) + ":" + two_digits(ss) + "." + two_digits(cs);
+
+        ts_result fast = scan_canonical_timestamp(ts);
+        ts_result slow = scan_timestamp_generic(ts);
+        int64_t expected = mm * 60000 + ss * 1000 + cs * 10;
+
+        bool ok = fast.ec == ts_errc::ok
+            &&  slow.ec == ts_errc::ok
+            &&  fast.duration == slow.duration
+            &&  fast.duration == parse_timestamp(ts)
+            &&  fast.duration == expected
+            &&  timestamp(fast.duration).as_string() == ts;
+
+        checked++;
+        if (!ok) {
+            failed++;
+            if (failed <= 10) cout << "MISMATCH ts=\"" << ts << "\"  fast=" << fast.duration
+                                   << "  slow=" << slow.duration << '\n';
+        }
+    }
+
+    // shapes that must be left to the general parser, or rejected
+    const vector<string> odd = {
+        "00:75.00", "99:99.99", "0a:00.00", "00-00.00", "00:00:00", "00.00:00",
+        "/0:00.00", ":0:00.00", "1:234.56", "-0:00.10", "        ", "00:00.0 "
+    };
+    for (const string& s : odd) {
+        ts_result fast = scan_canonical_timestamp(s);
+        ts_result full = scan_timestamp(s);
+        ts_result slow = scan_timestamp_generic(s);
+
+        bool ok = full.ec == slow.ec && full.duration == slow.duration
+            && (fast.ec == ts_errc::not_a_timestamp
+                || (fast.ec == slow.ec && fast.duration == slow.duration));
+
+        checked++;
+        if (!ok) failed++;
+        PRINT("scan_canonical_timestamp", s, ok ? "PASS" : "FAIL");
+    }
+
+    cout << checked << " timestamps checked, " << failed << " mismatches  "
+         << (failed == 0 ? "PASS" : "FAIL") << '\n';
+}
+
 /* ---------- tokenize_lyric_line ---------- */
 void TEST_tokenize_lyric_line()
 {
@@ -177,6 +341,60 @@ void TEST_tokenize_lyric_line()
     run("[ti: Ella][ar:Junior H] [00:00:00] Y una bolsita");
     run("[of:-150] Si de mí todo entregué y siempre me han pagado mal");
     run("[ti: Ella][ar:Junior H] [00:00:00] Y una bolsita");
+
+    /* caller-owned buffer: appended to, capacity kept after clear() */
+    token_buffer buffer;
+    tokenize_line("[00:01.00] one", buffer, true);
+    tokenize_line("[00:02.00] two", buffer, true);
+    size_t capacity = buffer.capacity();
+    cout << "BUFFER: " << buffer.size() << " tokens after two lines\n";
+
+    buffer.clear();
+    tokenize_line("[00:03.00] three", buffer, true);
+    cout << "BUFFER: " << buffer.size() << " tokens after clear, reallocated: "
+         << (buffer.capacity() != capacity ? "yes" : "no") << "\n\n";
+}
+
+/* ---------- tokenize_line vs a byte-at-a-time reference ---------- */
+static vector<string_view> reference_tokenize(string_view source, bool lyrics)
+{
+    vector<string_view> tokens;
+    size_t start = 0;
+    for (size_t i = 0; i <= source.size(); i++) {
+        bool end = i == source.size();
+        bool tag = !end && lyrics && string_view("[]<>").find(source[i]) != string_view::npos;
+        if (end || source[i] == ' ' || tag) {
+            if (i > start) tokens.push_back(source.substr(start, i - start));
+            if (tag) tokens.push_back(source.substr(i, 1));
+            start = i + 1;
+        }
+    }
+    return tokens;
+}
+
+void TEST_tokenize_differential()
+{
+    cout << "\n===== tokenize_line vs reference (all block offsets) =====\n";
+
+    const string alphabet = "ab [c]<d>:0. ";
+    long checked = 0;
+    long failed = 0;
+
+    // every length up to a few SIMD blocks, deterministic contents
+    for (size_t length = 0; length < 100; length++)
+    for (size_t seed = 0; seed < 13; seed++) {
+        string line;
+        for (size_t i = 0; i < length; i++)
+            line += alphabet[(i * 7 + seed * 5 + i / 3) % alphabet.size()];
+
+        for (bool lyrics : {false, true}) {
+            checked++;
+            if (tokenize_line(line, lyrics) != reference_tokenize(line, lyrics)) failed++;
+        }
+    }
+
+    cout << checked << " lines checked, " << failed << " mismatches  "
+         << (failed == 0 ? "PASS" : "FAIL") << '\n';
 }
 
 /* ---------- serialize_lyric_tokens ---------- */
@@ -217,6 +435,50 @@ void TEST_apply_offset_to_timestamp()
     run("99:59.99", off);
     run("123:456.789", off);
     run("04:32.227", off);
+
+    // rounding warnings were buffered in this thread's sink
+    thread_diagnostics().flush(cout);
+}
+
+/* ---------- apply_offsets (batch kernel) ---------- */
+void TEST_apply_offsets()
+{
+    cout << "\n===== apply_offsets (batch vs apply_offset) =====\n";
+
+    // odd length on purpose, so the scalar tail runs as well
+    vector<int64_t> column;
+    for (int64_t i = -50; i < 1003; i++) column.push_back(i * 977 - 3000);
+
+    for (long offset : {750L, -1500L, 0L, -250L})
+        for (bool inv : {false, true}) {
+            vector<int64_t> batch = column;
+            apply_offsets(batch, offset, inv);
+
+            long failed = 0;
+            for (size_t i = 0; i < column.size(); i++)
+                if (batch[i] != timestamp(column[i]).apply_offset(offset, inv).as_ms()) failed++;
+
+            cout << column.size() << " durations, offset=" << offset << ", invert=" << inv << ", "
+                 << failed << " mismatches  " << (failed == 0 ? "PASS" : "FAIL") << '\n';
+        }
+
+    /* runs sharing an offset, like a document with several [offset:] */
+    const vector<offset_range> ranges = {
+        {0, 300, 750}, {300, 301, -1500}, {301, 900, 0}, {900, column.size(), -250}
+    };
+
+    for (bool inv : {false, true}) {
+        vector<int64_t> batch = column;
+        apply_offsets(batch, ranges, inv);
+
+        long failed = 0;
+        for (const offset_range& r : ranges)
+            for (size_t i = r.begin; i < r.end; i++)
+                if (batch[i] != timestamp(column[i]).apply_offset(r.offset, inv).as_ms()) failed++;
+
+        cout << column.size() << " durations in ranges, invert=" << inv << ", "
+             << failed << " mismatches  " << (failed == 0 ? "PASS" : "FAIL") << '\n';
+    }
 }
 
 /* ---------- correct_line_offset ---------- */
@@ -234,6 +496,54 @@ void TEST_correct_line_offset()
     run("[3252:3405:405] Another untouched timestamp", off);
 }
 
+/* ---------- lex_line ---------- */
+void TEST_lex_line()
+{
+    cout << "\n===== lex_line =====\n";
+    static const char *names[] = {
+        "text", "open", "close", "<", ">", "colon", "ts", "key", "value"
+    };
+
+    auto run = [](const string& line){
+        lexeme_buffer lexemes;
+        lex_line(line, lexemes);
+        cout << "LINE: \"" << line << "\"\nLEXEMES: ";
+        for (const lexeme& l : lexemes) {
+            cout << names[int(l.kind)] << "{" << l.view << "}";
+            if (l.kind == lexeme_kind::timestamp) cout << "=" << l.duration;
+            if (l.colon != string_view::npos) cout << "@" << l.colon;
+            cout << " ";
+        }
+        cout << "\n";
+
+        /* lexemes serialize back exactly like the raw tokens do */
+        bool same = serialize_tokens(lexemes) == serialize_tokens(tokenize_line(line, true), " ", true);
+        cout << "ROUND TRIP: " << (same ? "PASS" : "FAIL") << "\n\n";
+    };
+
+    run("[00:12.34] Hello [ar:Junior H]");
+    run("[offset: -750]<00:01.00>word [ti : Ella ]");
+    run("[offset 00:01.00] text: not a tag");
+    run("[re:Replay:Extra] [malformed");
+    run("[0:1.234] rounded");
+}
+
+/* ---------- trim_view ---------- */
+void TEST_trim_view()
+{
+    cout << "\n===== trim_view =====\n";
+    auto run = [](const string& s){
+        string_view out = trim_view(s);
+        bool inside = out.empty() || (out.data() >= s.data() && out.data() + out.size() <= s.data() + s.size());
+        PRINT("trim_view", s, string(out) + (inside ? "" : "  FAIL"));
+    };
+    run("  [ti: Ella]  ");
+    run("\t lyrics\t");
+    run("no spaces");
+    run("   ");
+    run("");
+}
+
 /* ---------- read_tags_from_line ---------- */
 void TEST_read_tags_from_line()
 {
@@ -262,6 +572,34 @@ void TEST_read_tags_from_line()
     run("[re:Replay:Extra]");        // colon inside value
 }
 
+/* ---------- read_tags_from_line (views) ---------- */
+void TEST_read_tag_views()
+{
+    cout << "\n===== read_tags_from_line (views) =====\n";
+    auto run = [](const string& line){
+        std::vector<tag_view> tags;
+        read_tags_from_line(line, tags);
+
+        cout << "LINE: \"" << line << "\"\nTAGS: ";
+        for (const tag_view& t : tags) {
+            cout << "'" << t.name << ": " << t.value << "' [" << t.begin << ", " << t.end << ") = "
+                 << line.substr(t.begin, t.end - t.begin) << " - ";
+        }
+
+        /* no copies: every value points back into the line */
+        bool inside = true;
+        for (const tag_view& t : tags)
+            if (!t.value.empty() && (t.value.data() < line.data() || t.value.data() + t.value.size() > line.data() + line.size()))
+                inside = false;
+        cout << "\nVIEWS INTO LINE: " << (inside ? "PASS" : "FAIL") << "\n\n";
+    };
+
+    run("[ti: Song name] lyrics");
+    run("[ar: Artist][al: Album][offset: 750]");
+    run("[01:53.00] Si de mí todo entregué");
+    run("[re:Replay:Extra] [malformed");
+}
+
 /* ---------- pop_tag ---------- */
 void TEST_pop_tag()
 {
@@ -290,6 +628,26 @@ void TEST_pop_tag()
     run(R"([space :  after] space test)", "space");// spaces inside tag
 }
 
+/* ---------- drop_tags ---------- */
+void TEST_drop_tags()
+{
+    cout << "\n===== drop_tags =====\n";
+    static constexpr id_tag_set tags = *parse_id_tag_set("ti,ar,al,offset");
+
+    auto run = [](const string& src){
+        PRINT("drop_tags(ti ar al offset of)", src, drop_tags(src, tags));
+    };
+
+    run(R"([ti: Ella][ar:Junior H] [00:00.00] Y una bolsita)");
+    run(R"([offset: 500][al:Album] I walk the line)");
+    run(R"([ ti :spaced][arranger:kept] exact keys only)");
+    run(R"([00:01.00][ti:x][00:02.00] timestamps stay)");
+    run(R"([ti:never closed)");
+    run(R"(plain text no brackets)");
+    run(R"([repeat:x][ar:a][ar:b][ar:c] every match in one pass)");
+    run(R"([of:-150][tool:kept] either offset spelling)");
+}
+
 /* ---------- helpers ---------- */
 static filelines split_multiline(const std::string& src)
 {
@@ -345,6 +703,466 @@ void TEST_process_lyrics_vector()
 [03:17.10]Now take me home
 [03:19.00]Take me home where I belong
 [03:23.20]I got no other place to go)", "correctoffset");
+
+    /* INPUT 4 (mid-file offset, honoured unless headeronly) ------------------ */
+    const string mid_file = R"([ti: Ella]
+[ar:Junior H]
+[offset: 500]
+
+[00:10.00]Y una bolsita
+[offset: -500]
+[00:20.00]pa' llevarla [ar:inline tag]
+[00:30.00]donde quiera)";
+    run(mid_file, "correctoffset dropmetadata");
+    run(mid_file, "correctoffset dropmetadata headeronly");
+}
+
+/* ---------- diagnostics ---------- */
+void TEST_diagnostics()
+{
+    cout << "\n===== diagnostics (cap of 3 per code) =====\n";
+
+    filelines in = {"[offset: abc]", "[00:01.00] fine"};
+    for (int i = 0; i < 10; i++) in.push_back("[00:7" + to_string(i) + ".00] rounded");
+    in.push_back("[offset:]");
+
+    diagnostics diag(3);
+    filelines out = process_lyrics(in, "correctoffset", diag);
+
+    cout << "rounded=" << diag.count(diag_code::rounded_timestamp)
+         << " bad offset=" << diag.count(diag_code::bad_offset_value)
+         << " total=" << diag.total() << '\n';
+    cout << diag.summary();
+
+    diag.flush(cout);
+    cout << "after flush total=" << diag.total() << '\n';
+}
+
+/* ---------- lyric_pipeline ---------- */
+void TEST_lyric_pipeline()
+{
+    cout << "\n===== lyric_pipeline =====\n";
+
+    /* options string parsed once, pipeline reused */
+    process_options parsed = parse_process_options("correctoffset:-250 invertoffset dropmetadata drop:tool");
+    cout << "PARSED: correct=" << parsed.correct_offset
+         << " override=" << parsed.offset_override.value_or(0)
+         << " invert=" << parsed.invert_offset
+         << " drops tool=" << bool(parsed.drop & id_tag_bit(id_tag::tool))
+         << " drops ti=" << bool(parsed.drop & id_tag_bit(id_tag::title)) << '\n';
+
+    const lyric_pipeline pipeline(parsed);
+    for (const char* doc : {"[tool: x]\n[00:01.00]one", "[ti: y]\n[00:02.00]two"}) {
+        for (auto& l : pipeline.run(split_multiline(doc))) cout << l << '\n';
+    }
+
+    /* typed options are the same as their string form */
+    process_options typed;
+    typed.correct_offset = true;
+    typed.offset_override = -250;
+    typed.invert_offset = true;
+    typed.drop = default_dropped_tags | id_tag_bit(id_tag::tool);
+
+    const filelines doc = split_multiline("[tool: x]\n[ti: y]\n[00:01.00]one\n[00:02.00]two");
+    bool same = lyric_pipeline(typed).run(doc) == process_lyrics(doc, "correctoffset:-250 invertoffset dropmetadata drop:tool");
+    cout << "TYPED == STRING: " << (same ? "PASS" : "FAIL") << '\n';
+
+    /* bad options are caught when the pipeline is built */
+    for (const char* bad : {"correctoffset:abc", "correctoffset:-", "correctoffset:.", "correctoffset:1.5", "drop:ti,nope", "dropmetdata"}) {
+        try {
+            lyric_pipeline p(bad);
+            cout << "\"" << bad << "\" accepted  FAIL\n";
+        } catch (const std::invalid_argument& e) {
+            cout << "\"" << bad << "\" rejected: " << e.what() << "  PASS\n";
+        }
+    }
+}
+
+/* ---------- lyric_stream ---------- */
+void TEST_lyric_stream()
+{
+    cout << "\n===== lyric_stream =====\n";
+
+    const string doc = R"([ti: Ella]
+[offset: 500]
+
+[00:10.00]Y una bolsita
+[offset: -500]
+[00:20.00]pa' llevarla [ar:inline tag]
+[00:75.00]rounded <00:30.00>word
+[00:30.00]donde quiera)";
+
+    /* every line comes out as soon as it's pushed */
+    const lyric_pipeline pipeline("correctoffset dropmetadata");
+    filelines streamed;
+    lyric_stream s(pipeline, [&](string_view line){ streamed.emplace_back(line); });
+
+    for (const string& line : split_multiline(doc)) {
+        size_t before = streamed.size();
+        s.push(line);
+        cout << "PUSH \"" << line << "\" -> "
+             << (streamed.size() > before ? "\"" + streamed.back() + "\"" : string("(dropped)")) << '\n';
+    }
+
+    /* same lines as the whole-document path, whatever the options */
+    for (const char* opts : {"correctoffset dropmetadata", "correctoffset:250 invertoffset", "dropmetadata headeronly", ""}) {
+        const lyric_pipeline p(opts);
+        filelines out;
+        lyric_stream st(p, [&](string_view line){ out.emplace_back(line); });
+        for (const string& line : split_multiline(doc)) st.push(line);
+
+        cout << "STREAM == RUN (" << opts << "): " << (out == p.run(split_multiline(doc)) ? "PASS" : "FAIL") << '\n';
+    }
+
+    /* run() corrects in batches of lines, offsets changing across them */
+    filelines long_doc;
+    for (int i = 0; i < 1000; i++) {
+        long_doc.push_back("[" + timestamp(i * 1000).as_string() + "]line <" + timestamp(i * 1000 + 500).as_string() + ">" + to_string(i));
+        if (i % 97 == 0) long_doc.push_back("[offset: " + to_string(i * 3 - 700) + "]");
+    }
+
+    for (const char* opts : {"correctoffset", "correctoffset verbatim invertoffset"}) {
+        const lyric_pipeline p(opts);
+        filelines out;
+        lyric_stream st(p, [&](string_view line){ out.emplace_back(line); });
+        for (const string& line : long_doc) st.push(line);
+
+        cout << "STREAM == RUN, batched (" << opts << "): " << (out == p.run(long_doc) ? "PASS" : "FAIL") << '\n';
+    }
+
+    /* istream to ostream, BOM and CR stripped */
+    std::istringstream in("\xEF\xBB\xBF[offset: 1000]\r\n[00:10.00]one\r\n[00:20.00]two\n");
+    std::ostringstream out;
+    size_t written = pipeline.stream(in, out);
+    cout << "STREAMED " << written << " lines:\n" << out.str();
+
+    thread_diagnostics().clear();
+}
+
+/* ---------- lyric_pipeline, split across threads ---------- */
+// Sets the running offset on lines mentioning some word, not through any [offset:] tag
+class cue_offset_stage : public lyric_stage {
+    private:
+        string cue;
+        long offset;
+
+    public:
+        cue_offset_stage (string cue, long offset) : cue(std::move(cue)), offset(offset) {}
+
+        bool
+        on_line (staged_line &line, stage_context &ctx) const override
+        {
+            if (line.source().find(this->cue) != string_view::npos) ctx.offset = this->offset;
+            return true;
+        }
+};
+
+void TEST_parallel_run()
+{
+    cout << "\n===== lyric_pipeline (threads) =====\n";
+
+    /* big enough to be split, with offsets, bad offsets and rounded timestamps all over */
+    filelines doc = {"[ti: Ella]", "[ar:Junior H]", "[offset: 750]", ""};
+    for (int i = 0; i < 60000; i++) {
+        if (i % 7919 == 0) doc.push_back("[offset: " + to_string(i % 2000 - 1000) + "]");
+        if (i % 15013 == 0) doc.push_back("[offset: nope]");
+        if (i % 997 == 0) doc.push_back("[00:" + to_string(60 + i % 39) + ".00]rounded [ar:inline]");
+        doc.push_back("[" + timestamp(int64_t(i) * 1000).as_string() + "]line " + to_string(i));
+    }
+
+    for (const char* opts : {"correctoffset dropmetadata", "correctoffset:300 invertoffset", "correctoffset headeronly"}) {
+        diagnostics serial_diag;
+        const filelines serial = lyric_pipeline(opts).run(doc, serial_diag);
+
+        for (const char* threads : {" threads:2", " threads:3", " threads:8", " threads:0"}) {
+            diagnostics parallel_diag;
+            const filelines parallel = lyric_pipeline(string(opts) + threads).run(doc, parallel_diag);
+
+            bool same = parallel == serial && parallel_diag.summary() == serial_diag.summary();
+            cout << "\"" << opts << threads << "\": " << (same ? "PASS" : "FAIL") << '\n';
+        }
+    }
+
+    /* custom stages may move the offset, so those pipelines stay on one thread */
+    auto cued = [&](const char* opts){
+        lyric_pipeline pipeline(opts);
+        pipeline.add_stage(make_shared<cue_offset_stage>("line 17000", -2000));
+        return pipeline.run(doc);
+    };
+
+    cout << "custom stage, threads:8: " << (cued("correctoffset threads:8") == cued("correctoffset") ? "PASS" : "FAIL") << '\n';
+}
+
+/* ---------- lrc_file ---------- */
+void TEST_lrc_file()
+{
+    cout << "\n===== lrc_file =====\n";
+
+    /* BOM, CRLF, a lone CR, an empty line and no final newline */
+    const string raw = "\xEF\xBB\xBF[offset: 500]\r\n[00:01.00]one\r[00:02.00]two\n\n[00:03.00]three";
+    const lrc_file file = lrc_file::from_memory(raw);
+
+    const vector<string_view> expected = {"[offset: 500]", "[00:01.00]one", "[00:02.00]two", "", "[00:03.00]three"};
+    bool same = file.lines().size() == expected.size();
+    for (size_t i = 0; same && i < expected.size(); i++)
+        same = file.lines()[i] == expected[i];
+    cout << "lines: " << (same ? "PASS" : "FAIL") << '\n';
+
+    const filelines owned = file.to_filelines();
+    cout << "to_filelines: " << (filelines(expected.begin(), expected.end()) == owned ? "PASS" : "FAIL") << '\n';
+
+    /* views and owned lines go through the same engine */
+    const lyric_pipeline pipeline("correctoffset dropmetadata");
+    cout << "run over views: " << (pipeline.run(file.lines()) == pipeline.run(owned) ? "PASS" : "FAIL") << '\n';
+
+    /* streaming cuts the very same lines, CR-only files included */
+    const string cr_only = "\xEF\xBB\xBF[offset: 500]\r[00:01.00]one\r\r[00:02.00]two\r";
+    istringstream in(cr_only);
+    ostringstream out;
+    pipeline.stream(in, out);
+
+    string written;
+    for (const string& l : pipeline.run(lrc_file::from_memory(cr_only).lines())) written.append(l).push_back('\n');
+    cout << "stream vs lrc_file: " << (out.str() == written ? "PASS" : "FAIL") << '\n';
+
+    cout << "empty: " << (lrc_file::from_memory("").lines().empty() && lrc_file::from_memory("\xEF\xBB\xBF").lines().empty() ? "PASS" : "FAIL") << '\n';
+
+    try {
+        lrc_file::from_memory("\xFF\xFE[\0" "0\0");
+        cout << "utf-16: FAIL\n";
+    } catch (const runtime_error&) {
+        cout << "utf-16: PASS\n";
+    }
+}
+
+/* ---------- verbatim patching ---------- */
+void TEST_patch_line()
+{
+    cout << "\n===== find_line_spans / patch_line =====\n";
+
+    vector<line_span> spans;
+    find_line_spans("[ti: Ella] 00:01.00", id_tag_bit(id_tag::title), true, spans);
+    bool found = spans.size() == 2
+        && spans[0].begin == 0 && spans[0].end == 10 && spans[0].drop
+        && spans[1].begin == 11 && spans[1].end == 19 && !spans[1].drop && spans[1].duration == 1000;
+    cout << "spans: " << (found ? "PASS" : "FAIL") << '\n';
+
+    // Patched from the spans, then checked against what the stages write back in verbatim mode
+    auto patch = [&](string_view in, id_tag_set drop, long offset){
+        string out;
+        spans.clear();
+        find_line_spans(in, drop, true, spans);
+        patch_line(in, spans, offset, false, out);
+        PRINT("patch", in, out);
+
+        staged_line::scratch buffers;
+        staged_line line(in, 1, true, buffers);
+        diagnostics diag;
+        stage_context ctx = {offset, diag};
+        drop_stage(drop).on_line(line, ctx);
+        correct_offset_stage().on_line(line, ctx);
+
+        string staged;
+        line.write(staged, true);
+        return staged == out ? out : "<" + staged + "> written back by the stages";
+    };
+
+    const id_tag_set ti = id_tag_bit(id_tag::title);
+
+    /* same width: a plain overwrite */
+    cout << (patch("[00:09.59]I think  <- two spaces", 0, 1000) == "[00:08.59]I think  <- two spaces" ? "PASS" : "FAIL") << '\n';
+    /* tag clipped, the spaces around it kept */
+    cout << (patch("[ti: Ella] [00:01.00]  a  b", ti, 500) == " [00:00.50]  a  b" ? "PASS" : "FAIL") << '\n';
+    /* timestamps inside a dropped tag go with it */
+    cout << (patch("x [ti:00:01.00] y", ti, 500) == "x  y" ? "PASS" : "FAIL") << '\n';
+    /* width changes */
+    cout << (patch("[0:01.50]<00:02.00>word", 0, -100000) == "[01:41.50]<01:42.00>word" ? "PASS" : "FAIL") << '\n';
+    /* nothing to patch */
+    cout << (patch("[ar: Junior H] plain", ti, 500) == "[ar: Junior H] plain" ? "PASS" : "FAIL") << '\n';
+
+    /* verbatim documents keep the same lines, only not rebuilt */
+    const filelines doc = {"[ti: Ella]", "[offset: 750]", "[00:09.59]I think", "[00:10.00] [ar:x]  spaced", "", "[00:11.00]end"};
+    const filelines out = lyric_pipeline("correctoffset dropmetadata verbatim").run(doc);
+    const filelines expected = {"[00:08.84]I think", "[00:09.25]   spaced", "[00:10.25]end"};
+    for (const string& l : out) cout << l << '\n';
+    cout << "verbatim run: " << (out == expected ? "PASS" : "FAIL") << '\n';
+
+    string streamed;
+    const lyric_pipeline verbatim("correctoffset dropmetadata verbatim");
+    lyric_stream s(verbatim, [&](string_view l){ streamed.append(l).push_back('\n'); });
+    for (const string& l : doc) s.push(l);
+    string joined;
+    for (const string& l : expected) joined.append(l).push_back('\n');
+    cout << "verbatim stream: " << (streamed == joined ? "PASS" : "FAIL") << '\n';
+}
+
+/* ---------- no-op detection ---------- */
+void TEST_would_change()
+{
+    cout << "\n===== lyric_pipeline::would_change =====\n";
+
+    const filelines fixed = {"[tool: syrinc]", "[00:01.00] one", "", "[00:02.00]two [la la]"};
+    const filelines tagged = {"[ti: Ella]", "[00:01.00] one"};
+    const filelines offset = {"[00:01.00] one", "[00:02.00][offset: 0] two"};
+
+    auto check = [](const char* title, bool got, bool expected){
+        cout << title << ": " << (got == expected ? "PASS" : "FAIL") << '\n';
+    };
+
+    check("fixed, correctoffset", lyric_pipeline("correctoffset").would_change(fixed), false);
+    check("fixed, dropmetadata", lyric_pipeline("correctoffset dropmetadata").would_change(fixed), false);
+    check("fixed, drop:tool", lyric_pipeline("drop:tool").would_change(fixed), true);
+    check("fixed, override", lyric_pipeline("correctoffset:500").would_change(fixed), true);
+    check("fixed, override 0", lyric_pipeline("correctoffset:0").would_change(fixed), false);
+    check("tagged, correctoffset", lyric_pipeline("correctoffset").would_change(tagged), false);
+    check("tagged, dropmetadata", lyric_pipeline("dropmetadata").would_change(tagged), true);
+    check("mid-file offset", lyric_pipeline("correctoffset").would_change(offset), true);
+    check("mid-file offset, headeronly", lyric_pipeline("correctoffset headeronly").would_change(offset), false);
+}
+
+/* ---------- stages ---------- */
+// Drops every line mentioning some word, to plug into a pipeline
+class drop_word_stage : public lyric_stage {
+    private:
+        string word;
+
+    public:
+        explicit drop_word_stage (string word) : word(std::move(word)) {}
+
+        bool
+        on_line (staged_line &line, stage_context &) const override
+        {
+            return line.source().find(this->word) == string_view::npos;
+        }
+};
+
+void TEST_stages()
+{
+    cout << "\n===== lyric_stage =====\n";
+
+    const filelines doc = {"[ti: Ella]", "[offset: 500]", "[00:03.00]three", "(untimed, follows three)", "[00:01.00]one", "[00:02.00]two", "[00:01.00]one", "[00:02.00] advert"};
+
+    auto show = [](const char* title, const filelines& out, const filelines& expected){
+        cout << title << ":\n";
+        for (const string& l : out) cout << "  " << l << '\n';
+        cout << (out == expected ? "PASS" : "FAIL") << '\n';
+    };
+
+    show("sort dedup", lyric_pipeline("correctoffset dropmetadata sort dedup").run(doc),
+        {"[00:00.50] one", "[00:01.50] two", "[00:01.50] advert", "[00:02.50] three", "(untimed, follows three)"});
+
+    show("timescale:2", lyric_pipeline("correctoffset timescale:2").run(doc),
+        {"[ti: Ella]", "[00:05.00] three", "(untimed, follows three)", "[00:01.00] one", "[00:03.00] two", "[00:01.00] one", "[00:03.00] advert"});
+
+    lyric_pipeline custom("dropmetadata verbatim");
+    custom.add_stage(make_shared<drop_word_stage>("advert"));
+    show("custom stage", custom.run(doc),
+        {"[00:03.00]three", "(untimed, follows three)", "[00:01.00]one", "[00:02.00]two", "[00:01.00]one"});
+
+    /* sorting needs the whole document, stream() waits for it */
+    const lyric_pipeline sorted("sort");
+    istringstream in("[00:02.00]b\n[00:01.00]a\n");
+    ostringstream out;
+    sorted.stream(in, out);
+    cout << "stream sort: " << (out.str() == "[00:01.00]a\n[00:02.00]b\n" ? "PASS" : "FAIL") << '\n';
+
+    try {
+        lyric_stream s(sorted, [](string_view){});
+        cout << "lyric_stream sort: FAIL\n";
+    } catch (const invalid_argument&) {
+        cout << "lyric_stream sort: PASS\n";
+    }
+
+    for (const char* bad : {"timescale:0", "timescale:-1", "timescale:fast", "timescale"}) {
+        try {
+            lyric_pipeline p(bad);
+            cout << bad << ": FAIL\n";
+        } catch (const invalid_argument&) {
+            cout << bad << ": PASS\n";
+        }
+    }
+}
+
+/* ---------- timeline ---------- */
+void TEST_timeline()
+{
+    cout << "\n===== sort_timeline / expand / collapse =====\n";
+
+    /* radix sort against a plain stable sort, ties included */
+    vector<timeline_entry> entries;
+    uint64_t seed = 88172645463325252ull;
+    for (uint32_t i = 0; i < 5000; i++) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        int64_t time = i % 50 == 0 ? timeline_start : int64_t(seed % (i % 2 ? 600000 : 40000000000ull));
+        if (i % 7 == 0 && time != timeline_start) time = -time;
+        entries.push_back({time, i, 0});
+    }
+
+    vector<timeline_entry> expected = entries;
+    stable_sort(expected.begin(), expected.end(), [](const timeline_entry& a, const timeline_entry& b){ return a.time < b.time; });
+    sort_timeline(entries);
+
+    bool same = true;
+    for (size_t i = 0; i < entries.size(); i++)
+        same = same && entries[i].time == expected[i].time && entries[i].line == expected[i].line;
+    cout << "sort_timeline: " << (same ? "PASS" : "FAIL") << '\n';
+
+    auto show = [](const char* title, const filelines& out, const filelines& expected){
+        cout << title << ":\n";
+        for (const string& l : out) cout << "  " << l << '\n';
+        cout << (out == expected ? "PASS" : "FAIL") << '\n';
+    };
+
+    const filelines doc = {"[ar: Junior H]", "[00:12.00][01:45.30]chorus", "(spoken)", "[00:20.00] verse", "[01:00.00] [02:10.00]  chorus"};
+
+    show("expand", lyric_pipeline("verbatim expand").run(doc),
+        {"[ar: Junior H]", "[00:12.00]chorus", "(spoken)", "[00:20.00] verse", "[01:00.00]  chorus", "[01:45.30]chorus", "[02:10.00]  chorus"});
+
+    show("collapse", lyric_pipeline("verbatim collapse").run(doc),
+        {"[ar: Junior H]", "[00:12.00][01:45.30][01:00.00][02:10.00]chorus", "(spoken)", "[00:20.00] verse"});
+
+    /* negative timestamps sort before 0, still after the header */
+    show("sort negative", lyric_pipeline("verbatim sort").run(filelines{"[ti: Ella]", "[00:02.00]b", "[-00:01.00]a", "[00:00.00]c"}),
+        {"[ti: Ella]", "[-00:01.00]a", "[00:00.00]c", "[00:02.00]b"});
+
+    show("expand then collapse", lyric_pipeline("verbatim expand collapse").run(doc),
+        {"[ar: Junior H]", "[00:12.00][01:00.00][01:45.30][02:10.00]chorus", "(spoken)", "[00:20.00] verse"});
+}
+
+/* ---------- enhanced LRC word timings ---------- */
+void TEST_word_timings()
+{
+    cout << "\n===== word timings =====\n";
+
+    staged_line::scratch buffers;
+    staged_line line("[00:01.00]<00:01.00>I <00:01.50>think [la <00:09.00>]", 1, true, buffers);
+    const line_timings& t = line.timings();
+
+    auto check = [](const char* title, bool passed){
+        cout << title << ": " << (passed ? "PASS" : "FAIL") << '\n';
+    };
+
+    check("timings", t.durations.size() == 4);
+    check("line timestamp", t.durations[0] == 1000 && t.words[0] == 0);
+    check("word timings", t.durations[1] == 1000 && t.durations[2] == 1500 && t.words[1] == 1 && t.words[2] == 1);
+    check("lexeme index", line.lexemes()[t.lexemes[2]].view == "00:01.50");
+
+    auto show = [](const char* title, const filelines& out, const filelines& expected){
+        cout << title << ":\n";
+        for (const string& l : out) cout << "  " << l << '\n';
+        cout << (out == expected ? "PASS" : "FAIL") << '\n';
+    };
+
+    const filelines doc = {"[offset: 500]", "[00:01.00]<00:01.00>I <00:01.50>think", "[00:02.00][00:12.00]<00:02.00>so <00:02.40>too [ar: Junior H]"};
+
+    show("rebuilt", lyric_pipeline("correctoffset dropmetadata").run(doc),
+        {"[00:00.50] <00:00.50> I <00:01.00> think", "[00:01.50] [00:11.50] <00:01.50> so <00:01.90> too"});
+
+    show("verbatim", lyric_pipeline("correctoffset dropmetadata verbatim").run(doc),
+        {"[00:00.50]<00:00.50>I <00:01.00>think", "[00:01.50][00:11.50]<00:01.50>so <00:01.90>too "});
+
+    show("expand", lyric_pipeline("verbatim expand").run(doc),
+        {"[00:01.00]<00:01.00>I <00:01.50>think", "[00:02.00]<00:02.00>so <00:02.40>too [ar: Junior H]", "[00:12.00]<00:12.00>so <00:12.40>too [ar: Junior H]"});
 }
 
 /* ---------- process_lyrics (file) ---------- */
@@ -372,13 +1190,30 @@ int main()
     TEST_ms_to_timestamp();
     TEST_timestamp_to_ms();
     TEST_round_trip();
+    TEST_canonical_timestamp_differential();
     TEST_tokenize_lyric_line();
+    TEST_tokenize_differential();
+    TEST_lex_line();
+    TEST_trim_view();
     TEST_serialize_lyric_tokens();
     TEST_apply_offset_to_timestamp();
+    TEST_apply_offsets();
     TEST_correct_line_offset();
     TEST_read_tags_from_line();
+    TEST_read_tag_views();
     TEST_pop_tag();
+    TEST_drop_tags();
     TEST_process_lyrics_vector();
+    TEST_diagnostics();
+    TEST_lyric_pipeline();
+    TEST_lyric_stream();
+    TEST_parallel_run();
+    TEST_lrc_file();
+    TEST_patch_line();
+    TEST_would_change();
+    TEST_stages();
+    TEST_timeline();
+    TEST_word_timings();
     TEST_process_lyrics_file();
     return 0;
 }
\ No newline at end of file